@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: BSD-3-Clause
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,297 +8,1988 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/stat.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/sendfile.h>
 #include <sys/eventfd.h>
-#include <libaio.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <ctype.h>
+#include <limits.h>
+#include <strings.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include "aws.h"
 #include "utils/util.h"
 #include "utils/debug.h"
+#include "utils/log.h"
 #include "utils/sock_util.h"
 #include "utils/w_epoll.h"
 
-/* server socket file descriptor */
-static int listenfd;
+/* label of each enum connection_state in the metrics */
+static const char *const aws_state_names[] = {
+	[STATE_INITIAL] = "initial",
+	[STATE_RECEIVING_DATA] = "receiving_data",
+	[STATE_REQUEST_RECEIVED] = "request_received",
+	[STATE_OPENING_FILE] = "opening_file",
+	[STATE_SENDING_DATA] = "sending_data",
+	[STATE_SENDING_HEADER] = "sending_header",
+	[STATE_SENDING_404] = "sending_404",
+	[STATE_ASYNC_ONGOING] = "async_ongoing",
+	[STATE_DATA_SENT] = "data_sent",
+	[STATE_HEADER_SENT] = "header_sent",
+	[STATE_404_SENT] = "404_sent",
+	[STATE_CONNECTION_CLOSED] = "connection_closed",
+};
+
+size_t aws_chunk_size = AWS_DYNAMIC_CHUNK;
+int aws_pipeline_depth = AWS_DYNAMIC_DEPTH;
+int aws_edge_triggered;
+#ifdef AWS_IO_URING
+int aws_splice;
+#endif
+unsigned int aws_header_timeout = AWS_HEADER_TIMEOUT;
+unsigned int aws_idle_timeout = AWS_IDLE_TIMEOUT;
+unsigned int aws_send_timeout = AWS_SEND_TIMEOUT;
+unsigned int aws_max_conns;	/* per loop */
+unsigned int aws_open_threads = AWS_OPEN_THREADS;
+struct offload_pool aws_open_pool;
+struct buf_budget aws_io_budget;
+
+/* Mount points, looked up once the request path is normalized */
+static const struct route aws_routes[] = {
+	{
+		.prefix = AWS_REL_STATIC_FOLDER,
+		.root = AWS_ABS_STATIC_FOLDER,
+		.handler = RESOURCE_TYPE_STATIC,
+		.cache_flags = FILE_CACHE_CONTENT | FILE_CACHE_ENCODINGS,
+	}, {
+		.prefix = AWS_REL_DYNAMIC_FOLDER,
+		.root = AWS_ABS_DYNAMIC_FOLDER,
+		.handler = RESOURCE_TYPE_DYNAMIC,
+	}, {
+		.prefix = AWS_METRICS_PATH,
+		.handler = RESOURCE_TYPE_METRICS,
+	},
+};
+
+static struct route_table aws_route_table;
+
+/*
+ * The path may come in several pieces when the request is received in
+ * several chunks. It is resolved in place: request_path holds the document
+ * root followed by the path without its leading '/'.
+ */
+static int aws_on_path_cb(http_parser *p, const char *buf, size_t len)
+{
+	struct connection *conn = (struct connection *)p->data;
 
-/* epoll file descriptor */
-static int epollfd;
+	if (len == 0)
+		return 0;
 
-static int aws_on_path_cb(http_parser *p, const char *buf, size_t len)
+	if (conn->path_len == 0) {
+		memcpy(conn->request_path, AWS_DOCUMENT_ROOT, sizeof(AWS_DOCUMENT_ROOT) - 1);
+		conn->path_len = sizeof(AWS_DOCUMENT_ROOT) - 1;
+		if (buf[0] == '/') {
+			buf++;
+			len--;
+		}
+	}
+
+	/* Longer paths fail the request. */
+	if (conn->path_len + len >= AWS_PATH_MAX)
+		return 1;
+
+	memcpy(conn->request_path + conn->path_len, buf, len);
+	conn->path_len += len;
+	conn->request_path[conn->path_len] = '\0';
+
+	return 0;
+}
+
+/* Where the value of the header being parsed goes, if we act upon it. */
+static struct aws_header_value *connection_header_slot(struct connection *conn)
+{
+	static const struct {
+		const char *name;
+		size_t offset;
+	} headers[] = {
+		{ "Range", offsetof(struct connection, range) },
+		{ "If-None-Match", offsetof(struct connection, if_none_match) },
+		{ "If-Modified-Since", offsetof(struct connection, if_modified_since) },
+		{ "Accept-Encoding", offsetof(struct connection, accept_encoding) },
+		{ "Transfer-Encoding", offsetof(struct connection, transfer_encoding) },
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(headers) / sizeof(headers[0]); i++)
+		if (conn->header_name_len == strlen(headers[i].name) &&
+		    strncasecmp(conn->header_name, headers[i].name,
+				conn->header_name_len) == 0)
+			return (struct aws_header_value *)((char *)conn + headers[i].offset);
+
+	return NULL;
+}
+
+/* Header names and values may also come in pieces; a name follows a value. */
+static int aws_on_header_field_cb(http_parser *p, const char *buf, size_t len)
 {
 	struct connection *conn = (struct connection *)p->data;
+	size_t n;
 
-	memcpy(conn->request_path, buf, len);
-	conn->request_path[len] = '\0';
-	conn->have_path = 1;
+	/* Trailers of a chunked body are not acted upon. */
+	if (conn->headers_done)
+		return 0;
+
+	if (conn->header_in_value) {
+		conn->header_in_value = 0;
+		conn->header_name_len = 0;
+	}
+
+	/* Names too long to be kept never match. */
+	n = conn->header_name_len < sizeof(conn->header_name) ?
+		sizeof(conn->header_name) - conn->header_name_len : 0;
+	memcpy(conn->header_name + conn->header_name_len, buf, len < n ? len : n);
+	conn->header_name_len += len;
 
 	return 0;
 }
 
+static int aws_on_header_value_cb(http_parser *p, const char *buf, size_t len)
+{
+	struct connection *conn = (struct connection *)p->data;
+	struct aws_header_value *value;
+
+	if (conn->headers_done)
+		return 0;
+
+	if (!conn->header_in_value) {
+		conn->header_in_value = 1;
+		conn->header_value = connection_header_slot(conn);
+	}
+
+	value = conn->header_value;
+	if (value == NULL || value->len == sizeof(value->buf))
+		return 0;
+
+	/* Values that do not fit are marked full and ignored. */
+	if (value->len + len >= sizeof(value->buf)) {
+		value->len = sizeof(value->buf);
+		return 0;
+	}
+
+	memcpy(value->buf + value->len, buf, len);
+	value->len += len;
+	value->buf[value->len] = '\0';
+
+	return 0;
+}
+
+/*
+ * The body, if any, follows: the parser skips it for us. It keeps a missing
+ * Content-Length as (size_t)-1, which it would take for an endless body.
+ */
+static int aws_on_headers_complete_cb(http_parser *p)
+{
+	struct connection *conn = (struct connection *)p->data;
+
+	conn->headers_done = 1;
+
+	if (p->content_length == (size_t)-1 && conn->transfer_encoding.len == 0)
+		return 1;
+
+	return 0;
+}
+
+/* Stop at the end of the request: what follows is the next one. */
+static int aws_on_message_complete_cb(http_parser *p)
+{
+	struct connection *conn = (struct connection *)p->data;
+
+	conn->request_done = 1;
+
+	return -1;
+}
+
+/* Every transition goes through here to keep the per-state gauges right. */
+static void connection_set_state(struct connection *conn, enum connection_state state)
+{
+	struct metrics *m = &conn->loop->metrics;
+
+	metrics_add(&m->states[conn->state], -1);
+	metrics_add(&m->states[state], 1);
+	conn->state = state;
+}
+
+/* (Re)start the connection's timer, or stop it for a timeout of 0. */
+static void connection_set_timeout(struct connection *conn, unsigned int seconds)
+{
+	struct timer_wheel *tw = &conn->loop->timers;
+
+	if (seconds == 0)
+		timer_cancel(tw, &conn->timer);
+	else
+		timer_arm(tw, &conn->timer, seconds * 1000ULL / AWS_TIMER_TICK_MS);
+}
+
+/* A piece of reply header, with its length */
+struct aws_str {
+	const char *s;
+	size_t len;
+};
+
+/* a string literal and its length, as arguments */
+#define AWS_LIT(s)	s, sizeof(s) - 1
+
+enum aws_status {
+	AWS_STATUS_200,
+	AWS_STATUS_206,
+	AWS_STATUS_304,
+	AWS_STATUS_404,
+	AWS_STATUS_431,
+	AWS_STATUS_416,
+	AWS_STATUS_503,
+	AWS_NR_STATUS
+};
+
+/* Status line and Connection header of a reply, by keep-alive */
+static const struct aws_str aws_status_lines[AWS_NR_STATUS][2] = {
+	[AWS_STATUS_200] = {
+		{ AWS_LIT("HTTP/1.1 200 OK\r\nConnection: close\r\n") },
+		{ AWS_LIT("HTTP/1.1 200 OK\r\nConnection: keep-alive\r\n") },
+	},
+	[AWS_STATUS_206] = {
+		{ AWS_LIT("HTTP/1.1 206 Partial Content\r\nConnection: close\r\n") },
+		{ AWS_LIT("HTTP/1.1 206 Partial Content\r\nConnection: keep-alive\r\n") },
+	},
+	[AWS_STATUS_304] = {
+		{ AWS_LIT("HTTP/1.1 304 Not Modified\r\nConnection: close\r\n") },
+		{ AWS_LIT("HTTP/1.1 304 Not Modified\r\nConnection: keep-alive\r\n") },
+	},
+	[AWS_STATUS_404] = {
+		{ AWS_LIT("HTTP/1.1 404 Not Found\r\nConnection: close\r\n") },
+		{ AWS_LIT("HTTP/1.1 404 Not Found\r\nConnection: keep-alive\r\n") },
+	},
+	[AWS_STATUS_431] = {
+		{ AWS_LIT("HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: close\r\n") },
+		{ AWS_LIT("HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: keep-alive\r\n") },
+	},
+	[AWS_STATUS_416] = {
+		{ AWS_LIT("HTTP/1.1 416 Range Not Satisfiable\r\nConnection: close\r\n") },
+		{ AWS_LIT("HTTP/1.1 416 Range Not Satisfiable\r\nConnection: keep-alive\r\n") },
+	},
+	[AWS_STATUS_503] = {
+		{ AWS_LIT("HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n") },
+		{ AWS_LIT("HTTP/1.1 503 Service Unavailable\r\nConnection: keep-alive\r\n") },
+	},
+};
+
+#define AWS_DATE_LINE_LEN	(sizeof("Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n") - 1)
+
+/* Date header of the current second, rendered by each thread once a second */
+static const char *aws_date_line(void)
+{
+	static __thread char line[AWS_DATE_LINE_LEN + 1];
+	static __thread time_t line_sec = -1;
+	time_t now = time(NULL);
+	struct tm tm;
+
+	if (now != line_sec) {
+		gmtime_r(&now, &tm);
+		strftime(line, sizeof(line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+		line_sec = now;
+	}
+
+	return line;
+}
+
+/* Add a piece of header sent from where it is, kept until the reply is sent. */
+static void connection_header_add(struct connection *conn, const char *s, size_t len)
+{
+	struct iovec *iov = &conn->header_iov[conn->header_iovcnt++];
+
+	iov->iov_base = (char *)s;
+	iov->iov_len = len;
+	conn->send_len += len;
+}
+
+/* Add a piece of header copied to send_buffer, merged with the last if there too. */
+static void connection_header_copy(struct connection *conn, const char *s, size_t len)
+{
+	struct iovec *last = &conn->header_iov[conn->header_iovcnt - 1];
+	char *p = conn->send_buffer + conn->send_used;
+
+	memcpy(p, s, len);
+	conn->send_used += len;
+	if ((char *)last->iov_base + last->iov_len != p) {
+		connection_header_add(conn, p, len);
+		return;
+	}
+	last->iov_len += len;
+	conn->send_len += len;
+}
+
+static void connection_header_number(struct connection *conn, size_t n)
+{
+	char digits[20];
+	size_t i = sizeof(digits);
+
+	do {
+		digits[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	connection_header_copy(conn, digits + i, sizeof(digits) - i);
+}
+
+/* Start a reply header: status line, Connection and Date. */
+static void connection_header_begin(struct connection *conn, enum aws_status status)
+{
+	const struct aws_str *line = &aws_status_lines[status][conn->keep_alive != 0];
+
+	conn->header_iovcnt = 0;
+	conn->header_pos = 0;
+	conn->send_used = 0;
+	conn->send_len = 0;
+	connection_header_add(conn, line->s, line->len);
+	connection_header_copy(conn, aws_date_line(), AWS_DATE_LINE_LEN);
+}
+
+/*
+ * Gather the iovecs of the reply header of a file. Its entity headers come
+ * pre-rendered from its cache entry; only the Date and the numbers of a
+ * range are written for the reply.
+ */
 static void connection_prepare_send_reply_header(struct connection *conn)
 {
-	/* TODO: Prepare the connection buffer to send the reply header. */
-	char s[BUFSIZ];
+	const struct file_cache_entry *entry = conn->cache_entry;
+
+	switch (conn->status_code) {
+	case 206:
+		connection_header_begin(conn, AWS_STATUS_206);
+		connection_header_add(conn, entry->header, entry->type_len);
+		connection_header_copy(conn, AWS_LIT("Content-Length: "));
+		connection_header_number(conn, conn->file_end - conn->file_offset);
+		connection_header_copy(conn, AWS_LIT("\r\nContent-Range: bytes "));
+		connection_header_number(conn, conn->file_offset);
+		connection_header_copy(conn, AWS_LIT("-"));
+		connection_header_number(conn, conn->file_end - 1);
+		connection_header_copy(conn, AWS_LIT("/"));
+		connection_header_number(conn, conn->file_size);
+		connection_header_copy(conn, AWS_LIT("\r\n"));
+		connection_header_add(conn, entry->header + entry->validators_off,
+				      entry->header_len - entry->validators_off);
+		break;
+	case 304:
+		connection_header_begin(conn, AWS_STATUS_304);
+		connection_header_add(conn, entry->header + entry->validators_off,
+				      entry->header_len - entry->validators_off);
+		break;
+	case 416:
+		connection_header_begin(conn, AWS_STATUS_416);
+		connection_header_copy(conn, AWS_LIT("Content-Length: 0\r\n"
+						     "Content-Range: bytes */"));
+		connection_header_number(conn, conn->file_size);
+		connection_header_copy(conn, AWS_LIT("\r\n\r\n"));
+		connection_set_state(conn, STATE_SENDING_HEADER);
+		return;
+	default:
+		connection_header_begin(conn, AWS_STATUS_200);
+		connection_header_add(conn, entry->header, entry->header_len);
+		break;
+	}
+	if (conn->encoding_header[0] != '\0')
+		connection_header_add(conn, conn->encoding_header,
+				      strlen(conn->encoding_header));
+	connection_header_add(conn, AWS_LIT("\r\n"));
+	connection_set_state(conn, STATE_SENDING_HEADER);
+
+	dlog(LOG_INFO, "This is the reply header: %zu bytes\n", conn->send_len);
+}
+
+/* The metrics of all loops, rendered into a body of the connection's own. */
+static void connection_prepare_send_metrics(struct connection *conn)
+{
+	conn->body = malloc(METRICS_TEXT_MAX);
+	DIE(conn->body == NULL, "malloc");
+
+	conn->file_size = metrics_render(conn->body, METRICS_TEXT_MAX,
+					 aws_state_names, STATE_NO_STATE);
+	conn->file_offset = 0;
+	conn->file_end = conn->file_size;
+
+	connection_header_begin(conn, AWS_STATUS_200);
+	connection_header_add(conn, AWS_LIT("Content-Type: text/plain; version=0.0.4\r\n"));
+	connection_header_copy(conn, AWS_LIT("Content-Length: "));
+	connection_header_number(conn, conn->file_size);
+	connection_header_copy(conn, AWS_LIT("\r\n"));
+	connection_header_add(conn, AWS_LIT("Cache-Control: no-store\r\n\r\n"));
+	connection_set_state(conn, STATE_SENDING_HEADER);
+}
 
-	sprintf(s, "HTTP/1.1 200 OK\r\n"
-			 "Connection: close\r\n"
-			 "Content-Length: %ld\r\n"
-			 "\r\n", conn->file_size);
+/* Static replies sent from memory: a small cached file or a generated body. */
+static const char *connection_content(struct connection *conn)
+{
+	if (conn->cache_entry)
+		return conn->cache_entry->content;
+
+	return conn->body;
+}
 
-	strcpy(conn->send_buffer, s);
-	conn->send_len = strlen(s);
-	conn->state = STATE_SENDING_HEADER;
+/* Account bytes written to the client, for the metrics and the access log. */
+static void connection_count_sent(struct connection *conn, size_t n)
+{
+	metrics_add(&conn->loop->metrics.bytes_sent, n);
+	conn->reply_sent += n;
 
-	dlog(LOG_INFO, "This is the reply: %s", conn->send_buffer);
+	/* The send timeout runs from the last progress made. */
+	connection_set_timeout(conn, aws_send_timeout);
 }
 
+/* Gather the header of a 404, 431 or 503 reply, which has no body. */
 static void connection_prepare_send_404(struct connection *conn)
 {
-	/* TODO: Prepare the connection buffer to send the 404 header. */
-	char s[BUFSIZ] = "HTTP/1.1 404 Not Found\r\n"
-			 "Connection: close\r\n"
-			 "Content-Length: 0\r\n"
-			 "\r\n";
-
-	strcpy(conn->send_buffer, s);
-	conn->send_len = strlen(s);
-	conn->state = STATE_SENDING_404;
+	switch (conn->status_code) {
+	case 431:
+		connection_header_begin(conn, AWS_STATUS_431);
+		break;
+	case 503:
+		connection_header_begin(conn, AWS_STATUS_503);
+		connection_header_add(conn, AWS_LIT("Retry-After: 1\r\n"));
+		break;
+	default:
+		connection_header_begin(conn, AWS_STATUS_404);
+		break;
+	}
+	connection_header_add(conn, AWS_LIT("Content-Length: 0\r\n\r\n"));
+	connection_set_state(conn, STATE_SENDING_404);
 }
 
+/*
+ * Normalize the request path and find the route serving it. For routes
+ * to files, the document root and the route's prefix are then replaced
+ * by the route's root, giving the path of the file.
+ */
 static enum resource_type connection_get_resource_type(struct connection *conn)
 {
-	/* TODO: Get resource type depending on request path/filename. Filename should
-	 * point to the static or dynamic folder.
-	 */
-	char s[10];
-	char *aux = malloc(strlen(conn->request_path) + 10);
+	char *path = conn->request_path + sizeof(AWS_DOCUMENT_ROOT) - 1;
+	size_t len = conn->path_len - (sizeof(AWS_DOCUMENT_ROOT) - 1);
+	size_t prefix_len;
+	size_t root_len;
+
+	/* Half rewritten, the path is of no use, even to the access log. */
+	if (route_normalize_path(path, &len) < 0) {
+		conn->request_path[0] = '\0';
+		conn->path_len = 0;
+		return RESOURCE_TYPE_NONE;
+	}
+	conn->path_len = sizeof(AWS_DOCUMENT_ROOT) - 1 + len;
+
+	dlog(LOG_INFO, "This is the path: %s\n", conn->request_path);
 
-	strcpy(aux, AWS_DOCUMENT_ROOT);
-	strcat(aux, conn->request_path + 1);
-	strcpy(conn->request_path, aux);
-	free(aux);
+	conn->route = route_lookup(&aws_route_table, path, len, &prefix_len);
+	if (conn->route == NULL)
+		return RESOURCE_TYPE_NONE;
+	if (conn->route->root == NULL)
+		return conn->route->handler;
 
-	strncpy(s, conn->request_path + strlen(AWS_DOCUMENT_ROOT), 9);
-	s[9] = '\0';
-	dlog(LOG_INFO, "This is the type: %s\n", s);
+	root_len = strlen(conn->route->root);
+	len -= prefix_len;
+	if (root_len + len >= AWS_PATH_MAX)
+		return RESOURCE_TYPE_NONE;
+	memmove(conn->request_path + root_len, path + prefix_len, len + 1);
+	memcpy(conn->request_path, conn->route->root, root_len);
+	conn->path_len = root_len + len;
 
-	if (strstr(s, "static")) {
-		dlog(LOG_INFO, "static\n");
-		strcpy(conn->filename, conn->request_path + 8);
-		return RESOURCE_TYPE_STATIC;
+	return conn->route->handler;
+}
+
+/* Whether a header was received, and fit in its buffer. */
+static int aws_header_present(const struct aws_header_value *value)
+{
+	return value->len > 0 && value->len < sizeof(value->buf);
+}
+
+/* Whether coding (or "*") is listed in Accept-Encoding without q=0. */
+static int aws_accepts_encoding(const char *list, const char *coding)
+{
+	size_t len = strlen(coding);
+	const char *p = list;
+	size_t n;
+
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+		n = strcspn(p, " \t,;");
+		if ((n == len && strncasecmp(p, coding, len) == 0) ||
+		    (n == 1 && *p == '*')) {
+			p += n;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			if (*p != ';')
+				return 1;
+			p++;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			return strncasecmp(p, "q=", 2) != 0 || strtod(p + 2, NULL) > 0;
+		}
+		while (*p != '\0' && *p != ',')
+			p++;
 	}
 
-	if (strstr(s, "dynamic")) {
-		dlog(LOG_INFO, "dynamic\n");
-		strcpy(conn->filename, conn->request_path + 9);
-		return RESOURCE_TYPE_DYNAMIC;
+	return 0;
+}
+
+/* Look for etag in an If-None-Match list; weak tags match too. */
+static int aws_etag_matches(const char *list, const char *etag)
+{
+	size_t len = strlen(etag);
+	const char *p = list;
+
+	while (*p != '\0') {
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+		if (*p == '*')
+			return 1;
+		if (strncmp(p, "W/", 2) == 0)
+			p += 2;
+		if (strncmp(p, etag, len) == 0 &&
+		    (p[len] == '\0' || p[len] == ',' || p[len] == ' ' || p[len] == '\t'))
+			return 1;
+		while (*p != '\0' && *p != ',')
+			p++;
 	}
 
-	return RESOURCE_TYPE_NONE;
+	return 0;
 }
 
+/*
+ * Whether the client's copy is current. If-None-Match takes precedence over
+ * If-Modified-Since, as in RFC 9110.
+ */
+static int connection_not_modified(struct connection *conn)
+{
+	const struct file_validators *v = conn->validators;
+	struct tm tm;
+	time_t since;
+
+	if (aws_header_present(&conn->if_none_match))
+		return aws_etag_matches(conn->if_none_match.buf, v->etag);
+
+	if (aws_header_present(&conn->if_modified_since)) {
+		memset(&tm, 0, sizeof(tm));
+		if (strptime(conn->if_modified_since.buf, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+			return 0;
+		/* A date in the future is invalid and ignored (RFC 9110 13.1.3). */
+		since = timegm(&tm);
+		return since <= time(NULL) && v->mtime <= since;
+	}
+
+	return 0;
+}
 
-struct connection *connection_create(int sockfd)
+/*
+ * Select the bytes of the file to send. A single "bytes=" range is
+ * honoured; other Range values are ignored and the whole file is sent.
+ */
+static void connection_apply_range(struct connection *conn)
 {
-	/* TODO: Initialize connection structure on given socket. */
-	int rc = 0;
-	struct connection *conn = malloc(sizeof(struct connection));
+	const char *p = conn->range.buf;
+	size_t size = conn->file_size;
+	unsigned long long first, last;
+	char *end;
 
-	DIE(conn == NULL, "malloc");
+	conn->file_offset = 0;
+	conn->file_end = size;
+	conn->status_code = 0;
 
+	if (!aws_header_present(&conn->range) || strncmp(p, "bytes=", 6) != 0)
+		return;
+	p += 6;
+
+	if (*p == '-') {
+		/* bytes=-N: the last N bytes */
+		if (!isdigit((unsigned char)p[1]))
+			return;
+		last = strtoull(p + 1, &end, 10);
+		if (*end != '\0')
+			return;
+		if (last == 0 || size == 0)
+			goto unsatisfiable;
+		first = last < size ? size - last : 0;
+		last = size - 1;
+	} else {
+		/* bytes=first- or bytes=first-last */
+		if (!isdigit((unsigned char)*p))
+			return;
+		first = strtoull(p, &end, 10);
+		if (*end != '-')
+			return;
+		p = end + 1;
+		if (*p == '\0') {
+			last = ULLONG_MAX;
+		} else {
+			if (!isdigit((unsigned char)*p))
+				return;
+			last = strtoull(p, &end, 10);
+			if (*end != '\0' || last < first)
+				return;
+		}
+		if (first >= size)
+			goto unsatisfiable;
+		if (last >= size)
+			last = size - 1;
+	}
+
+	conn->file_offset = first;
+	conn->file_end = last + 1;
+	conn->status_code = 206;
+	return;
+
+unsatisfiable:
+	/* Only the header is sent. */
+	conn->file_end = 0;
+	conn->status_code = 416;
+}
+
+static void connection_settle(struct connection *conn);
+static void connection_open_job(struct offload_job *job);
+
+/* A connection outlived its header, idle or send timeout: drop it. */
+static void connection_expire(struct timer *t)
+{
+	static const struct linger reset = { .l_onoff = 1, .l_linger = 0 };
+	struct connection *conn = (struct connection *)
+		((char *)t - offsetof(struct connection, timer));
+
+	dlog(LOG_INFO, "Connection timed out in state %s\n", aws_state_names[conn->state]);
+	metrics_add(&conn->loop->metrics.timeouts, 1);
+
+	/* Reset rather than leave a stalled reply queued in the kernel. */
+	if (OUT_STATE(conn->state) || conn->state == STATE_ASYNC_ONGOING)
+		setsockopt(conn->sockfd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+	connection_set_state(conn, STATE_CONNECTION_CLOSED);
+	connection_settle(conn);
+}
+
+/* Set up the handler of an accepted socket, waiting for a first request. */
+struct connection *connection_create(struct aws_loop *loop, int sockfd)
+{
+	struct connection *conn = slab_cache_alloc(&loop->conn_cache);
+
+	conn->loop = loop;
 	conn->sockfd = sockfd;
-	memset(conn->recv_buffer, 0, BUFSIZ);
-	memset(conn->send_buffer, 0, BUFSIZ);
-	memset(conn->request_path, 0, BUFSIZ);
+	conn->recv_buffer = conn->recv_inline;
+	conn->recv_size = sizeof(conn->recv_inline);
+	conn->request_path[0] = '\0';
+	conn->path_len = 0;
+	conn->route = NULL;
+	conn->headers_done = 0;
+	conn->request_done = 0;
+	conn->header_name_len = 0;
+	conn->header_in_value = 0;
+	conn->range.len = 0;
+	conn->if_none_match.len = 0;
+	conn->if_modified_since.len = 0;
+	conn->accept_encoding.len = 0;
+	conn->transfer_encoding.len = 0;
+	conn->encoding_header = "";
+	conn->res_type = RESOURCE_TYPE_NONE;
 
 	conn->recv_len = 0;
+	conn->parsed_len = 0;
 	conn->send_len = 0;
 	conn->fd = -1;
+	conn->cache_entry = NULL;
+	conn->file_size = 0;
+	conn->file_pos = 0;
+	conn->file_offset = 0;
+	conn->file_end = 0;
+	conn->status_code = 0;
+	conn->state = STATE_INITIAL;
+	metrics_add(&loop->metrics.states[STATE_INITIAL], 1);
+	conn->async_read_len = 0;
+	conn->keep_alive = 0;
+	conn->can_recv = 0;
+	conn->can_send = 0;
+	conn->poll_events = EPOLLIN;
+#ifdef AWS_IO_URING
+	conn->read_op.conn = conn;
+	conn->read_op.is_send = 0;
+	conn->send_op.conn = conn;
+	conn->send_op.is_send = 1;
+	conn->buf_index = -1;
+	conn->io_buf = NULL;
+	conn->pipe.rd = -1;
+	conn->pipe.wr = -1;
+#else
+	conn->chunks = NULL;
+#endif
+	conn->buf_wait_pprev = NULL;
+	conn->aio_inflight = 0;
+	conn->open_job.fn = connection_open_job;
+	conn->opened = NULL;
+	conn->open_pending = 0;
+	conn->body = NULL;
+	conn->accept_time = metrics_now_usec();
+	conn->request_start = conn->accept_time;
+	conn->first_byte_sent = 0;
+	conn->nr_requests = 0;
+	conn->reply_sent = 0;
+
+	/* The first request is due from the moment the client connects. */
+	timer_init(&conn->timer, connection_expire);
+	connection_set_timeout(conn, aws_header_timeout);
+
+	return conn;
+}
+
+/*
+ * Wait on the socket for what the connection needs next. Edge-triggered
+ * sockets are registered for everything once, and the handlers are driven
+ * from connection_settle() instead. The interest set is only changed when
+ * it differs from the current one.
+ */
+static void connection_poll_in(struct connection *conn)
+{
+	if (aws_edge_triggered || conn->poll_events == EPOLLIN)
+		return;
+	w_epoll_update_ptr_in(conn->loop->epollfd, conn->sockfd, conn);
+	conn->poll_events = EPOLLIN;
+}
+
+static void connection_poll_out(struct connection *conn)
+{
+	if (aws_edge_triggered || conn->poll_events == EPOLLOUT)
+		return;
+	w_epoll_update_ptr_out(conn->loop->epollfd, conn->sockfd, conn);
+	conn->poll_events = EPOLLOUT;
+}
+
+static void connection_poll_none(struct connection *conn)
+{
+	if (aws_edge_triggered || conn->poll_events == 0)
+		return;
+	w_epoll_update_ptr_none(conn->loop->epollfd, conn->sockfd, conn);
+	conn->poll_events = 0;
+}
+
+/*
+ * Park a dynamic transfer left without a chunk buffer by the budget, or,
+ * with libaio, without room in the loop's context. Its socket has no
+ * events registered and nothing may be in flight: it only moves again
+ * from aws_loop_wake_buffer_waiters(), or when dropped.
+ */
+static void connection_wait_buffer(struct connection *conn)
+{
+	struct aws_loop *loop = conn->loop;
+
+	if (conn->buf_wait_pprev != NULL)
+		return;
+
+	conn->buf_wait_next = NULL;
+	conn->buf_wait_pprev = loop->buf_waiters_tail;
+	*loop->buf_waiters_tail = conn;
+	loop->buf_waiters_tail = &conn->buf_wait_next;
+	metrics_add(&loop->metrics.buffer_waits, 1);
+}
+
+static void connection_unwait_buffer(struct connection *conn)
+{
+	struct aws_loop *loop = conn->loop;
+
+	if (conn->buf_wait_pprev == NULL)
+		return;
+
+	*conn->buf_wait_pprev = conn->buf_wait_next;
+	if (conn->buf_wait_next != NULL)
+		conn->buf_wait_next->buf_wait_pprev = conn->buf_wait_pprev;
+	else
+		loop->buf_waiters_tail = conn->buf_wait_pprev;
+	conn->buf_wait_pprev = NULL;
+	metrics_add(&loop->metrics.buffer_waits, -1);
+}
+
+#ifdef AWS_IO_URING
+/*
+ * Take one of the loop's registered buffers for a dynamic transfer. When
+ * they are all in use, fall back to a pool buffer and plain reads. Returns
+ * -1 when the pool is over budget too.
+ */
+static int connection_get_io_buffer(struct connection *conn)
+{
+	struct aws_loop *loop = conn->loop;
+
+	if (loop->nr_free_buffers > 0) {
+		conn->buf_index = loop->free_buffers[--loop->nr_free_buffers];
+		conn->io_buf = loop->ring_buffers + (size_t)conn->buf_index * aws_chunk_size;
+		return 0;
+	}
+
+	conn->buf_index = -1;
+	conn->io_buf = buf_pool_get(&loop->chunk_pool);
+
+	return conn->io_buf != NULL ? 0 : -1;
+}
+
+static int aws_loop_has_io_buffer(struct aws_loop *loop)
+{
+	return loop->nr_free_buffers > 0 || buf_pool_available(&loop->chunk_pool);
+}
+
+static void connection_put_io_buffer(struct connection *conn)
+{
+	struct aws_loop *loop = conn->loop;
+
+	if (conn->buf_index >= 0)
+		loop->free_buffers[loop->nr_free_buffers++] = conn->buf_index;
+	else if (conn->io_buf != NULL)
+		buf_pool_put(&loop->chunk_pool, conn->io_buf);
+	conn->buf_index = -1;
+	conn->io_buf = NULL;
+}
+
+/* Queue a send of what is left of the current chunk. */
+static void connection_queue_send(struct connection *conn)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&conn->loop->ring);
+	if (sqe == NULL) {
+		io_uring_submit(&conn->loop->ring);
+		sqe = io_uring_get_sqe(&conn->loop->ring);
+		DIE(sqe == NULL, "io_uring_get_sqe");
+	}
+
+	io_uring_prep_send(sqe, conn->sockfd, conn->io_buf + conn->send_pos,
+			   conn->chunk_len - conn->send_pos, MSG_NOSIGNAL);
+	io_uring_sqe_set_data(sqe, &conn->send_op);
+	conn->aio_inflight++;
+	metrics_add(&conn->loop->metrics.async_inflight, 1);
+}
+
+/*
+ * Queue the next chunk of the file as a read linked to the send of the same
+ * buffer: the kernel runs the send as soon as the read is done, without a
+ * round trip through the loop. Nothing is submitted here; the loop submits
+ * everything queued at once before going back to epoll_wait().
+ */
+void connection_start_async_io(struct connection *conn)
+{
+	struct io_uring *ring = &conn->loop->ring;
+	struct io_uring_sqe *sqe;
+	size_t len;
+
+	len = conn->file_end - conn->async_read_len;
+	if (len > aws_chunk_size)
+		len = aws_chunk_size;
+	conn->chunk_len = len;
+	conn->send_pos = 0;
+	conn->read_pending = 1;
+	conn->read_failed = 0;
+	conn->send_cancelled = 0;
+
+	/* A link must not be split across two submissions. */
+	if (io_uring_sq_space_left(ring) < 2)
+		io_uring_submit(ring);
+
+	sqe = io_uring_get_sqe(ring);
+	DIE(sqe == NULL, "io_uring_get_sqe");
+	if (conn->buf_index >= 0)
+		io_uring_prep_read_fixed(sqe, conn->fd, conn->io_buf, len,
+					 conn->async_read_len, conn->buf_index);
+	else
+		io_uring_prep_read(sqe, conn->fd, conn->io_buf, len,
+				   conn->async_read_len);
+	io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+	io_uring_sqe_set_data(sqe, &conn->read_op);
+	conn->aio_inflight++;
+	metrics_add(&conn->loop->metrics.async_inflight, 1);
+
+	connection_queue_send(conn);
+}
+
+/* Start the transfer once it has a buffer, or wait for one. */
+static void connection_resume_async_io(struct connection *conn)
+{
+	if (connection_get_io_buffer(conn) < 0) {
+		connection_wait_buffer(conn);
+		return;
+	}
+
+	connection_start_async_io(conn);
+}
+
+/*
+ * Take a pipe for a spliced transfer from the loop, or make one about a
+ * chunk large. Returns -1 when no pipe can be had, out of fds or over the
+ * pipe buffer limits.
+ */
+static int connection_get_pipe(struct connection *conn)
+{
+	struct aws_loop *loop = conn->loop;
+	int fds[2];
+	int size;
+
+	if (loop->nr_free_pipes > 0) {
+		conn->pipe = loop->free_pipes[--loop->nr_free_pipes];
+		return 0;
+	}
+
+	if (pipe2(fds, O_CLOEXEC) < 0)
+		return -1;
+
+	/* Past fs.pipe-max-size the pipe keeps its size and chunks shrink to it. */
+	fcntl(fds[1], F_SETPIPE_SZ, (int)aws_chunk_size);
+	size = fcntl(fds[1], F_GETPIPE_SZ);
+	if (size <= 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	conn->pipe.rd = fds[0];
+	conn->pipe.wr = fds[1];
+	conn->pipe.size = size;
+
+	return 0;
+}
+
+/*
+ * Hand the pipe back to the loop. One left with data in it by a transfer
+ * cut short is closed instead: the next transfer would send that data.
+ */
+static void connection_put_pipe(struct connection *conn, int drained)
+{
+	struct aws_loop *loop = conn->loop;
+
+	if (conn->pipe.rd < 0)
+		return;
+
+	if (drained && loop->nr_free_pipes < AWS_URING_PIPES) {
+		loop->free_pipes[loop->nr_free_pipes++] = conn->pipe;
+	} else {
+		close(conn->pipe.rd);
+		close(conn->pipe.wr);
+	}
+	conn->pipe.rd = -1;
+	conn->pipe.wr = -1;
+}
+
+/*
+ * Queue a splice of the next chunk of the file into the transfer's empty
+ * pipe. The ring runs it off the loop, so a page cache miss only holds up
+ * this transfer. Splicing out of the pipe is left to the loop: IORING_OP_
+ * SPLICE does not wait for a socket to be writable, it fails with EAGAIN.
+ */
+static void connection_start_splice(struct connection *conn)
+{
+	struct io_uring_sqe *sqe;
+	size_t len;
+
+	len = conn->file_end - conn->async_read_len;
+	if (len > aws_chunk_size)
+		len = aws_chunk_size;
+	if (len > conn->pipe.size)
+		len = conn->pipe.size;
+	conn->chunk_len = len;
+	conn->send_pos = 0;
+	conn->read_pending = 1;
+
+	sqe = io_uring_get_sqe(&conn->loop->ring);
+	if (sqe == NULL) {
+		io_uring_submit(&conn->loop->ring);
+		sqe = io_uring_get_sqe(&conn->loop->ring);
+		DIE(sqe == NULL, "io_uring_get_sqe");
+	}
+
+	io_uring_prep_splice(sqe, conn->fd, conn->async_read_len, conn->pipe.wr,
+			     -1, len, 0);
+	io_uring_sqe_set_data(sqe, &conn->read_op);
+	conn->aio_inflight++;
+	metrics_add(&conn->loop->metrics.async_inflight, 1);
+}
+
+/* The pipe holds the chunk (or the part a short splice got): send it. */
+static void connection_complete_splice(struct connection *conn, int res)
+{
+	conn->read_pending = 0;
+	if (res <= 0) {
+		conn->keep_alive = 0;
+		connection_set_state(conn, STATE_DATA_SENT);
+		return;
+	}
+
+	conn->chunk_len = res;
+	connection_set_state(conn, STATE_SENDING_DATA);
+	connection_poll_out(conn);
+}
+
+/*
+ * Splice the pipe into the socket as far as it takes it, like sendfile()
+ * does for static files, then have the ring refill the pipe.
+ */
+static enum connection_state connection_send_spliced(struct connection *conn)
+{
+	ssize_t bytes_sent;
+
+	while (conn->state == STATE_SENDING_DATA) {
+		bytes_sent = splice(conn->pipe.rd, NULL, conn->sockfd, NULL,
+				    conn->chunk_len - conn->send_pos,
+				    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (bytes_sent < 0 && errno == EAGAIN) {
+			conn->can_send = 0;
+			break;
+		}
+		if (bytes_sent <= 0) {
+			conn->keep_alive = 0;
+			connection_set_state(conn, STATE_DATA_SENT);
+			break;
+		}
+
+		connection_count_sent(conn, bytes_sent);
+		conn->send_pos += bytes_sent;
+		if (conn->send_pos < conn->chunk_len)
+			continue;
+
+		conn->async_read_len += conn->chunk_len;
+		if (conn->async_read_len >= conn->file_end) {
+			connection_put_pipe(conn, 1);
+			connection_set_state(conn, STATE_DATA_SENT);
+			break;
+		}
+
+		connection_set_state(conn, STATE_ASYNC_ONGOING);
+		connection_poll_none(conn);
+		connection_start_splice(conn);
+	}
+
+	return conn->state;
+}
+
+/*
+ * Start sending a dynamic file. The socket stays registered with no events
+ * while the ring owns the transfer, so only errors and hangups wake us up.
+ */
+static void connection_begin_async_io(struct connection *conn)
+{
+	conn->async_read_len = conn->file_offset;
+	conn->send_len = 0;
+
+	if (conn->file_offset == conn->file_end) {
+		connection_set_state(conn, STATE_DATA_SENT);
+		return;
+	}
+
+	connection_set_state(conn, STATE_ASYNC_ONGOING);
+	connection_poll_none(conn);
+
+	/* Without a pipe, the transfer goes through a buffer instead. */
+	if (aws_splice && connection_get_pipe(conn) == 0) {
+		connection_start_splice(conn);
+		return;
+	}
+
+	connection_resume_async_io(conn);
+}
+#else
+/*
+ * Set up the pipeline of a transfer. Chunk buffers are borrowed from the
+ * loop's pool for each read and handed back once sent, so small files take
+ * only one and slow clients hold no more than what they have yet to get.
+ */
+static void connection_get_chunks(struct connection *conn)
+{
+	int i;
+
+	conn->chunks = slab_cache_alloc(&conn->loop->chunks_cache);
+	for (i = 0; i < aws_pipeline_depth; i++)
+		conn->chunks[i].buf = NULL;
+}
+
+static void connection_put_chunks(struct connection *conn)
+{
+	int i;
+
+	if (conn->chunks == NULL)
+		return;
+
+	for (i = 0; i < aws_pipeline_depth; i++)
+		if (conn->chunks[i].buf != NULL)
+			buf_pool_put(&conn->loop->chunk_pool, conn->chunks[i].buf);
+	slab_cache_free(&conn->loop->chunks_cache, conn->chunks);
+	conn->chunks = NULL;
+}
+
+/*
+ * Read ahead into every free slot of the pipeline, with a single
+ * io_submit() for all of them.
+ */
+void connection_start_async_io(struct connection *conn)
+{
+	struct iocb *piocb[AWS_MAX_DEPTH];
+	struct aws_chunk *chunk;
+	size_t len;
+	int nr = 0;
+	int rc;
+
+	while (conn->chunk_tail - conn->chunk_head < (unsigned int)aws_pipeline_depth &&
+	       conn->read_pos < conn->file_end) {
+		chunk = &conn->chunks[conn->chunk_tail % aws_pipeline_depth];
+		len = conn->file_end - conn->read_pos;
+		if (len > aws_chunk_size)
+			len = aws_chunk_size;
+
+		if (chunk->buf == NULL) {
+			chunk->buf = buf_pool_get(&conn->loop->chunk_pool);
+			if (chunk->buf == NULL)
+				break;
+		}
+		io_prep_pread(&chunk->iocb, conn->fd, chunk->buf, len, conn->read_pos);
+		io_set_eventfd(&chunk->iocb, conn->loop->aio_eventfd);
+		chunk->iocb.data = conn;
+		chunk->ready = 0;
+		piocb[nr++] = &chunk->iocb;
+
+		conn->read_pos += len;
+		conn->chunk_tail++;
+	}
+	if (nr == 0) {
+		/* Over budget with nothing left to send: wait for a buffer. */
+		if (conn->chunk_tail == conn->chunk_head && conn->read_pos < conn->file_end)
+			connection_wait_buffer(conn);
+		return;
+	}
+
+	rc = io_submit(conn->loop->aio_ctx, nr, piocb);
+	if (rc < 0 && rc != -EAGAIN) {
+		conn->keep_alive = 0;
+		connection_set_state(conn, STATE_DATA_SENT);
+		return;
+	}
+	if (rc < 0)
+		rc = 0;
+	conn->aio_inflight += rc;
+	metrics_add(&conn->loop->metrics.async_inflight, rc);
+
+	/*
+	 * The loop's context is full: take back the reads not submitted and
+	 * wait for completions to make room, rather than block on them here.
+	 * Their chunks keep the buffers they were given.
+	 */
+	if (rc < nr) {
+		conn->chunk_tail -= nr - rc;
+		conn->read_pos = piocb[rc]->u.c.offset;
+		conn->loop->aio_full = 1;
+		connection_wait_buffer(conn);
+	}
+}
+
+static int aws_loop_has_io_buffer(struct aws_loop *loop)
+{
+	return buf_pool_available(&loop->chunk_pool);
+}
+
+static void connection_resume_async_io(struct connection *conn)
+{
+	connection_start_async_io(conn);
+}
+
+/*
+ * Start sending a dynamic file. Until the first chunk has been read the
+ * socket stays registered with no events, so only hangups wake us up.
+ */
+static void connection_begin_async_io(struct connection *conn)
+{
+	dlog(LOG_INFO, "Started reading from file\n");
+	conn->async_read_len = conn->file_offset;
+	conn->send_pos = 0;
+	conn->read_pos = conn->file_offset;
+	conn->chunk_head = 0;
+	conn->chunk_tail = 0;
+
+	if (conn->file_offset == conn->file_end) {
+		connection_set_state(conn, STATE_DATA_SENT);
+		return;
+	}
+
+	connection_get_chunks(conn);
+	connection_set_state(conn, STATE_ASYNC_ONGOING);
+	connection_poll_none(conn);
+	connection_start_async_io(conn);
+}
+#endif
+
+/*
+ * Restart the transfers parked for want of a chunk buffer, oldest first,
+ * while the budget allows. Any loop may have handed buffers back, so this
+ * runs after every batch of events, at least once a tick; reads completed
+ * in the batch may also have made room in a full libaio context.
+ */
+static void aws_loop_wake_buffer_waiters(struct aws_loop *loop)
+{
+	struct connection *conn;
+
+#ifndef AWS_IO_URING
+	loop->aio_full = 0;
+#endif
+	while ((conn = loop->buf_waiters) != NULL && aws_loop_has_io_buffer(loop)) {
+#ifndef AWS_IO_URING
+		/* Turned down again: the rest waits for more completions. */
+		if (loop->aio_full)
+			break;
+#endif
+		connection_unwait_buffer(conn);
+		connection_resume_async_io(conn);
+		connection_settle(conn);
+	}
+}
+
+/* Release the file of the current request, cached or not. */
+static void connection_close_file(struct connection *conn)
+{
+	if (conn->cache_entry) {
+		file_cache_put(&conn->loop->file_cache, conn->cache_entry);
+		conn->cache_entry = NULL;
+	} else if (conn->fd >= 0) {
+		close(conn->fd);
+	}
+	conn->fd = -1;
+	free(conn->body);
+	conn->body = NULL;
+}
+
+/*
+ * Close the connection and release what it holds, once nothing in flight
+ * points to it; the handler itself is freed after the current batch.
+ */
+void connection_remove(struct connection *conn)
+{
+	timer_cancel(&conn->loop->timers, &conn->timer);
+	connection_unwait_buffer(conn);
+	w_epoll_remove_ptr(conn->loop->epollfd, conn->sockfd, conn);
+	if (conn->aio_inflight > 0 || conn->open_pending) {
+		/*
+		 * Async requests still point at conn: make them fail fast and
+		 * let the last completion free it.
+		 */
+		shutdown(conn->sockfd, SHUT_RDWR);
+		connection_set_state(conn, STATE_CONNECTION_CLOSED);
+		return;
+	}
+#ifdef AWS_IO_URING
+	connection_put_io_buffer(conn);
+	connection_put_pipe(conn, 0);
+#else
+	connection_put_chunks(conn);
+#endif
+	connection_close_file(conn);
+	close(conn->sockfd);
+	metrics_observe(&conn->loop->metrics.conn_duration,
+			metrics_now_usec() - conn->accept_time);
+	connection_set_state(conn, STATE_CONNECTION_CLOSED);
+	if (conn->recv_buffer != conn->recv_inline)
+		buf_pool_put(&conn->loop->recv_pool, conn->recv_buffer);
+
+	/* Events for conn may still be pending in the current batch. */
+	conn->closed_next = conn->loop->closed;
+	conn->loop->closed = conn;
+}
+
+/* Stop watching the listener: new connections wait in its backlog. */
+static void aws_loop_pause_accept(struct aws_loop *loop)
+{
+	int rc;
+
+	if (loop->accept_paused)
+		return;
+
+	rc = w_epoll_update_ptr_none(loop->epollfd, loop->listenfd, &loop->listenfd);
+	DIE(rc < 0, "w_epoll_update_ptr_none");
+	loop->accept_paused = 1;
+	metrics_add(&loop->metrics.accept_paused, 1);
+}
+
+/* Accept again once back under budget and done waiting for fds. */
+static void aws_loop_resume_accept(struct aws_loop *loop)
+{
+	int rc;
+
+	if (!loop->accept_paused || loop->conn_cache.nr_objs >= aws_max_conns ||
+	    timer_armed(&loop->accept_timer))
+		return;
+
+	if (aws_edge_triggered)
+		rc = w_epoll_update_ptr_in_et(loop->epollfd, loop->listenfd, &loop->listenfd);
+	else
+		rc = w_epoll_update_ptr_in(loop->epollfd, loop->listenfd, &loop->listenfd);
+	DIE(rc < 0, "w_epoll_update_ptr_in");
+	loop->accept_paused = 0;
+	loop->accept_ready = 1;
+	metrics_add(&loop->metrics.accept_paused, -1);
+}
+
+static void aws_loop_accept_retry(struct timer *t)
+{
+	struct aws_loop *loop = (struct aws_loop *)
+		((char *)t - offsetof(struct aws_loop, accept_timer));
+
+	if (loop->spare_fd < 0)
+		loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	aws_loop_resume_accept(loop);
+}
+
+/*
+ * Out of fds: rather than leave the listener readable, spend the spare fd
+ * on accepting the oldest pending connection and closing it at once, so
+ * its client fails fast, then pause accepting for a while.
+ */
+static void aws_loop_shed(struct aws_loop *loop)
+{
+	int sockfd;
+
+	if (loop->spare_fd >= 0) {
+		close(loop->spare_fd);
+		sockfd = accept4(loop->listenfd, NULL, NULL, SOCK_CLOEXEC);
+		if (sockfd >= 0) {
+			close(sockfd);
+			metrics_add(&loop->metrics.shed, 1);
+		}
+		/* Another thread may take the fd first: retried with the timer. */
+		loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	}
+
+	timer_arm(&loop->timers, &loop->accept_timer,
+		  AWS_ACCEPT_RETRY_MS / AWS_TIMER_TICK_MS);
+	aws_loop_pause_accept(loop);
+}
+
+/* Take the connections waiting on the loop's listener. */
+void handle_new_connection(struct aws_loop *loop)
+{
+	int sockfd;
+	socklen_t addrlen = sizeof(struct sockaddr_in);
+	struct sockaddr_in addr;
+	struct connection *conn;
+	static const int one = 1;
+	int rc;
+	int nr;
+
+	/*
+	 * Accept new connections, a batch at most: the rest are taken in the
+	 * next rounds, after the events of the connections being served.
+	 */
+	for (nr = 0; nr < AWS_ACCEPT_BATCH; nr++) {
+		if (loop->conn_cache.nr_objs >= aws_max_conns) {
+			aws_loop_pause_accept(loop);
+			return;
+		}
+
+		addrlen = sizeof(struct sockaddr_in);
+		sockfd = accept4(loop->listenfd, (SSA *) &addr, &addrlen,
+				 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sockfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE ||
+			    errno == ENOBUFS || errno == ENOMEM) {
+				aws_loop_shed(loop);
+				return;
+			}
+			if (errno != EAGAIN)
+				ERR("accept4");
+			loop->accept_ready = 0;
+			return;
+		}
+
+		dlog(LOG_INFO, "Accepted connection from: %s:%d on loop %d\n",
+			inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), loop->id);
+
+		/*
+		 * Replies are sent whole, so Nagle only ever holds back their
+		 * last segment for the client's delayed ACK. What must go out
+		 * together is sent with MSG_MORE instead.
+		 */
+		setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		conn = connection_create(loop, sockfd);
+		conn->peer_addr = addr.sin_addr;
+		metrics_add(&loop->metrics.accepted, 1);
+
+		if (aws_edge_triggered)
+			rc = w_epoll_add_ptr_inout_et(loop->epollfd, sockfd, conn);
+		else
+			rc = w_epoll_add_ptr_in(loop->epollfd, sockfd, conn);
+		if (rc < 0) {
+			ERR("w_epoll_add_ptr");
+			connection_remove(conn);
+			continue;
+		}
+
+		http_parser_init(&(conn->request_parser), HTTP_REQUEST);
+	}
+}
+
+/* Move a request that no longer fits recv_inline to a pool buffer. */
+static void connection_grow_recv_buffer(struct connection *conn)
+{
+	char *buf = buf_pool_get(&conn->loop->recv_pool);
+
+	memcpy(buf, conn->recv_buffer, conn->recv_len);
+	conn->recv_buffer = buf;
+	conn->recv_size = BUFSIZ;
+}
+
+/* Give the pool buffer back once what is left fits inline again. */
+static void connection_shrink_recv_buffer(struct connection *conn)
+{
+	if (conn->recv_buffer == conn->recv_inline ||
+	    conn->recv_len > sizeof(conn->recv_inline))
+		return;
+
+	memcpy(conn->recv_inline, conn->recv_buffer, conn->recv_len);
+	buf_pool_put(&conn->loop->recv_pool, conn->recv_buffer);
+	conn->recv_buffer = conn->recv_inline;
+	conn->recv_size = sizeof(conn->recv_inline);
+}
+
+/* Receive what the socket has into recv_buffer, and act on it. */
+void receive_data(struct connection *conn)
+{
+	ssize_t bytes_recv;
+
+	connection_set_state(conn, STATE_RECEIVING_DATA);
+
+	if (conn->recv_len == conn->recv_size)
+		connection_grow_recv_buffer(conn);
+
+	bytes_recv = recv(conn->sockfd, conn->recv_buffer + conn->recv_len, conn->recv_size - conn->recv_len, 0);
+
+	if (bytes_recv < 0 && errno == EAGAIN) {
+		conn->can_recv = 0;
+		return;
+	}
+	if (bytes_recv <= 0) {
+		connection_set_state(conn, STATE_CONNECTION_CLOSED);
+		return;
+	}
+
+	conn->recv_len += bytes_recv;
+
+	connection_process_request(conn);
+}
+
+/* Answer the request received, its file open if it has one. */
+static void connection_start_reply(struct connection *conn)
+{
+	if (conn->res_type == RESOURCE_TYPE_STATIC ||
+	    conn->res_type == RESOURCE_TYPE_DYNAMIC) {
+		/* A revalidated copy only gets the header: file_end stays 0. */
+		if (connection_not_modified(conn))
+			conn->status_code = 304;
+		else
+			connection_apply_range(conn);
+	}
+
+	if (conn->res_type == RESOURCE_TYPE_NONE)
+		connection_prepare_send_404(conn);
+	else if (conn->res_type == RESOURCE_TYPE_METRICS)
+		connection_prepare_send_metrics(conn);
+	else
+		connection_prepare_send_reply_header(conn);
+
+	/* Most replies fit in the socket buffer: don't wait for EPOLLOUT. */
+	handle_output(conn);
+	if (OUT_STATE(conn->state))
+		connection_poll_out(conn);
+}
+
+/*
+ * Start serving the first request sitting in recv_buffer, if it has been
+ * fully received. Bytes past the end of that request belong to pipelined
+ * requests and are left in the buffer for later.
+ */
+void connection_process_request(struct connection *conn)
+{
+	int rc;
+
+	if (conn->request_start == 0) {
+		conn->request_start = metrics_now_usec();
+		connection_set_timeout(conn, aws_header_timeout);
+	}
+
+	rc = parse_header(conn);
+	if (rc == 0 && conn->recv_len < BUFSIZ)
+		return;
+	if (rc == 0) {
+		/* A header that does not fit in recv_buffer is turned down. */
+		conn->status_code = 431;
+		conn->keep_alive = 0;
+		conn->recv_len = 0;
+		rc = -1;
+	}
+
+	connection_set_state(conn, STATE_REQUEST_RECEIVED);
+	connection_set_timeout(conn, aws_send_timeout);
+	if (rc > 0)
+		conn->res_type = connection_get_resource_type(conn);
+	else
+		conn->res_type = RESOURCE_TYPE_NONE;
+
+	/* Once the pool has opened the file, connection_file_opened() goes on. */
+	if ((conn->res_type == RESOURCE_TYPE_STATIC ||
+	     conn->res_type == RESOURCE_TYPE_DYNAMIC) &&
+	    connection_open_file(conn) > 0)
+		return;
+
+	connection_start_reply(conn);
+}
+
+/*
+ * Get ready for the next request on a persistent connection: drop the
+ * per-request state but keep any pipelined bytes already in recv_buffer.
+ */
+static void connection_reset(struct connection *conn)
+{
+	connection_close_file(conn);
 	conn->file_size = 0;
-	conn->state = STATE_INITIAL;
+	conn->file_pos = 0;
+	conn->file_offset = 0;
+	conn->file_end = 0;
+	conn->status_code = 0;
+	conn->send_len = 0;
+	conn->send_pos = 0;
 	conn->async_read_len = 0;
+#ifndef AWS_IO_URING
+	connection_put_chunks(conn);
+#endif
+	connection_shrink_recv_buffer(conn);
+	conn->path_len = 0;
+	conn->headers_done = 0;
+	conn->request_done = 0;
+	conn->parsed_len = 0;
+	conn->header_name_len = 0;
+	conn->header_in_value = 0;
+	conn->range.len = 0;
+	conn->if_none_match.len = 0;
+	conn->if_modified_since.len = 0;
+	conn->accept_encoding.len = 0;
+	conn->transfer_encoding.len = 0;
+	conn->encoding_header = "";
+	conn->request_path[0] = '\0';
+	conn->route = NULL;
+	conn->res_type = RESOURCE_TYPE_NONE;
+	conn->keep_alive = 0;
+	connection_set_state(conn, STATE_INITIAL);
+	conn->request_start = 0;
+	conn->first_byte_sent = 0;
+	conn->reply_sent = 0;
+	http_parser_init(&(conn->request_parser), HTTP_REQUEST);
+}
 
-	dlog(LOG_INFO, "Wow have created new socket and rc is: %d\n", rc);
+/* Status line code of the reply being sent. */
+static int connection_status(struct connection *conn)
+{
+	if (conn->status_code != 0)
+		return conn->status_code;
 
-	return conn;
+	return conn->res_type == RESOURCE_TYPE_NONE ? 404 : 200;
 }
 
-void connection_start_async_io(struct connection *conn)
+/*
+ * Access log line of a finished request, in the Common Log Format followed
+ * by the time taken in microseconds.
+ */
+static void connection_log_access(struct connection *conn, uint64_t elapsed)
 {
-	/* TODO: Start asynchronous operation (read from file).
-	 * Use io_submit(2) & friends for reading data asynchronously.
+	const http_parser *p = &conn->request_parser;
+	const char *path = "-";
+	char addr[INET_ADDRSTRLEN];
+	char route_path[AWS_PATH_MAX + 1];
+
+	/*
+	 * Skip the document root, keeping the leading '/', or go back from
+	 * a file path to the route's prefix.
 	 */
-	int rc;
+	if (conn->route != NULL && conn->route->root != NULL) {
+		snprintf(route_path, sizeof(route_path), "/%s%s", conn->route->prefix,
+			 conn->request_path + strlen(conn->route->root));
+		path = route_path;
+	} else if (conn->path_len > 0) {
+		path = conn->request_path + strlen(AWS_DOCUMENT_ROOT) - 1;
+	}
 
-	memset(&(conn->iocb), 0, sizeof(conn->iocb));
-	memset(conn->send_buffer, 0, BUFSIZ);
-	dlog(LOG_INFO, "This is what fd is: %d\n", conn->fd);
-	io_prep_pread(&(conn->iocb), conn->fd, conn->send_buffer, BUFSIZ, conn->async_read_len);
-	conn->piocb[0] = &(conn->iocb);
-	rc = io_submit(conn->ctx, 1, conn->piocb);
-	dlog(LOG_INFO, "This is what rc is for read: %d\n", rc);
+	inet_ntop(AF_INET, &conn->peer_addr, addr, sizeof(addr));
+	log_printf(LOG_STREAM_ACCESS, "%s - - [%s] \"%s %s HTTP/%d.%d\" %d %zu %llu\n",
+		   addr, log_date(), http_method_str(p->method), path,
+		   p->http_major, p->http_minor, connection_status(conn),
+		   conn->reply_sent, (unsigned long long)elapsed);
 }
 
-void connection_remove(struct connection *conn)
+/*
+ * The reply has been fully sent: either close the connection or, when the
+ * client asked for a persistent one, go back to waiting for a request.
+ */
+static void connection_finish_request(struct connection *conn)
 {
-	/* TODO: Remove connection handler. */
-	close(conn->sockfd);
-	conn->state = STATE_CONNECTION_CLOSED;
-	free(conn);
-	dlog(LOG_INFO, "I GOT RID OF CONNECTION\n");
+	struct metrics *m = &conn->loop->metrics;
+	uint64_t elapsed = metrics_now_usec() - conn->request_start;
+
+	metrics_add(&m->requests, 1);
+	conn->nr_requests++;
+	if (conn->first_byte_sent)
+		metrics_observe(&m->last_byte, elapsed);
+	if (log_enabled(LOG_STREAM_ACCESS))
+		connection_log_access(conn, elapsed);
+
+	if (!conn->keep_alive) {
+		connection_set_state(conn, STATE_CONNECTION_CLOSED);
+		return;
+	}
+
+	connection_reset(conn);
+	connection_poll_in(conn);
+	connection_set_timeout(conn, aws_idle_timeout);
+
+	if (conn->recv_len > 0)
+		connection_process_request(conn);
 }
 
-void handle_new_connection(void)
+/*
+ * Have the pool open request_path, parking the connection meanwhile: its
+ * socket is left with no events, only errors and hangups wake it up.
+ */
+static void connection_offload_open(struct connection *conn, unsigned int flags,
+				    const char *encoding)
 {
-	/* TODO: Handle a new connection request on the server socket. */
-	static int sockfd;
-	socklen_t addrlen = sizeof(struct sockaddr_in);
-	struct sockaddr_in addr;
-	struct connection *conn;
-	int rc;
-
-	/* TODO: Accept new connection. */
-	sockfd = accept(listenfd, (SSA *) &addr, &addrlen);
-	DIE(sockfd < 0, "accept");
+	conn->open_flags = flags;
+	conn->open_encoding = encoding;
+	conn->open_pending = 1;
+	connection_set_state(conn, STATE_OPENING_FILE);
+	connection_poll_none(conn);
+	offload_submit(&aws_open_pool, &conn->open_job, &conn->loop->opens_done);
+}
 
-	dlog(LOG_ERR, "Accepted connection from: %s:%d\n",
-		inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+/* Runs on a pool thread, which looks at nothing but the request path. */
+static void connection_open_job(struct offload_job *job)
+{
+	struct connection *conn = (struct connection *)
+		((char *)job - offsetof(struct connection, open_job));
 
-	/* TODO: Set socket to be non-blocking. */
-	int fileflags = fcntl(sockfd, F_GETFL);
+	conn->opened = file_cache_load(conn->request_path, conn->open_flags);
+	conn->open_errno = conn->opened == NULL ? errno : 0;
+}
 
-	fcntl(sockfd, F_SETFL, fileflags | FNDELAY | FASYNC);
+/*
+ * Switch a static file to a precompressed sibling the client accepts. The
+ * sibling is a cached file of its own, sent as is with sendfile(). Returns
+ * 1 while the pool opens a sibling missing from the cache, 0 otherwise.
+ */
+static int connection_select_encoding(struct connection *conn)
+{
+	static const struct {
+		unsigned int encoding;
+		const char *coding;
+		const char *suffix;
+		const char *header;
+	} codings[] = {
+		{ FILE_ENCODING_BR, "br", ".br",
+		  "Content-Encoding: br\r\nVary: Accept-Encoding\r\n" },
+		{ FILE_ENCODING_GZIP, "gzip", ".gz",
+		  "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" },
+	};
+	struct file_cache_entry *entry;
+	unsigned int encodings;
+	size_t i;
 
+	encodings = file_cache_encodings(conn->cache_entry);
+	if (encodings == 0)
+		return 0;
 
-	/* TODO: Instantiate new connection handler. */
-	conn = connection_create(sockfd);
+	/* The reply depends on Accept-Encoding, whichever file is sent. */
+	conn->encoding_header = "Vary: Accept-Encoding\r\n";
+	if (!aws_header_present(&conn->accept_encoding))
+		return 0;
 
-	/* TODO: Add socket to epoll. */
-	rc = w_epoll_add_ptr_in(epollfd, sockfd, conn);
-	DIE(rc < 0, "w_epoll_add_in");
+	for (i = 0; i < sizeof(codings) / sizeof(codings[0]); i++) {
+		if (!(encodings & codings[i].encoding) ||
+		    !aws_accepts_encoding(conn->accept_encoding.buf, codings[i].coding) ||
+		    conn->path_len + strlen(codings[i].suffix) >= AWS_PATH_MAX)
+			continue;
+
+		/* The suffix stays on the path until the pool is done with it. */
+		strcpy(conn->request_path + conn->path_len, codings[i].suffix);
+		entry = file_cache_lookup(&conn->loop->file_cache, conn->request_path);
+		if (entry == NULL && aws_open_threads > 0) {
+			connection_offload_open(conn, FILE_CACHE_CONTENT, codings[i].header);
+			return 1;
+		}
+		if (entry == NULL)
+			entry = file_cache_get(&conn->loop->file_cache, conn->request_path,
+					       FILE_CACHE_CONTENT);
+		conn->request_path[conn->path_len] = '\0';
+		if (entry == NULL)
+			continue;
+
+		file_cache_put(&conn->loop->file_cache, conn->cache_entry);
+		conn->cache_entry = entry;
+		conn->encoding_header = codings[i].header;
+		return 0;
+	}
 
-	/* TODO: Initialize HTTP_REQUEST parser. */
-	http_parser_init(&(conn->request_parser), HTTP_REQUEST);
+	return 0;
 }
 
-void receive_data(struct connection *conn)
+/* Serve the file of cache_entry, once the right encoding of it is there. */
+static void connection_set_file(struct connection *conn)
 {
-	/* TODO: Receive message on socket.
-	 * Store message in recv_buffer in struct connection.
-	 */
-	ssize_t bytes_recv;
+	dlog(LOG_INFO, "We have opened the file: %d\n", conn->cache_entry->fd);
 
-	dlog(LOG_INFO, "Wow we are waiting to read something\n");
-
-	conn->state = STATE_RECEIVING_DATA;
+	conn->fd = conn->cache_entry->fd;
+	conn->file_size = conn->cache_entry->size;
+	conn->validators = &conn->cache_entry->validators;
+}
 
-	bytes_recv = recv(conn->sockfd, conn->recv_buffer + conn->recv_len, BUFSIZ - conn->recv_len, 0);
+/* Take entry as the file of the request; NULL when there is none. */
+static int connection_use_file(struct connection *conn, struct file_cache_entry *entry)
+{
+	conn->cache_entry = entry;
+	if (entry == NULL) {
+		conn->res_type = RESOURCE_TYPE_NONE;
+		conn->file_size = 0;
 
-	if (bytes_recv <= 0) {
-		conn->state = STATE_CONNECTION_CLOSED;
-		w_epoll_remove_ptr(epollfd, conn->sockfd, conn);
-		connection_remove(conn);
-		return;
+		/*
+		 * Out of descriptors, the file may well be there: say so, as
+		 * a 503, and give the connection's own descriptor back.
+		 */
+		if (conn->open_errno == EMFILE || conn->open_errno == ENFILE) {
+			conn->status_code = 503;
+			conn->keep_alive = 0;
+		}
+		return -1;
 	}
 
-	conn->recv_len += bytes_recv;
-	dlog(LOG_INFO, "Wow we have read something: %s\n", conn->recv_buffer);
-
-	if (!strcmp(conn->recv_buffer + conn->recv_len - 4, "\r\n\r\n")) {
-		conn->request_parser.data = conn;
-		conn->state = STATE_REQUEST_RECEIVED;
-		parse_header(conn);
-		conn->res_type = connection_get_resource_type(conn);
-		connection_open_file(conn);
-		w_epoll_update_ptr_out(epollfd, conn->sockfd, conn);
-	}
+	if (conn->res_type == RESOURCE_TYPE_STATIC && connection_select_encoding(conn) > 0)
+		return 1;
+	connection_set_file(conn);
 
-	if (conn->state == STATE_REQUEST_RECEIVED) {
-		if (conn->res_type == RESOURCE_TYPE_NONE)
-			connection_prepare_send_404(conn);
-		else
-			connection_prepare_send_reply_header(conn);
-	}
+	return 0;
 }
 
+/*
+ * Find the file of the request. Returns 1 while the pool opens it, or -1
+ * when there is none: a 404, or a 503 when out of descriptors.
+ */
 int connection_open_file(struct connection *conn)
 {
-	/* TODO: Open file and update connection fields. */
-	conn->fd = open(conn->request_path, O_RDWR);
+	struct file_cache_entry *entry;
+
+	/*
+	 * Files come from the loop's cache, without any syscall on a hit:
+	 * every transfer of a file shares one descriptor, sendfile() and
+	 * positioned reads alike. Routes tell whether small files are also
+	 * kept in memory. Misses are left to the pool when there is one.
+	 */
+	entry = file_cache_lookup(&conn->loop->file_cache, conn->request_path);
+	if (entry == NULL && aws_open_threads > 0) {
+		connection_offload_open(conn, conn->route->cache_flags, NULL);
+		return 1;
+	}
+	if (entry == NULL) {
+		entry = file_cache_get(&conn->loop->file_cache, conn->request_path,
+				       conn->route->cache_flags);
+		conn->open_errno = entry == NULL ? errno : 0;
+	}
 
-	dlog(LOG_INFO, "We have opened the file: %d\n", conn->fd);
+	return connection_use_file(conn, entry);
+}
 
-	if (conn->fd == -1) {
-		conn->res_type = RESOURCE_TYPE_NONE;
-		conn->file_size = 0;
+/*
+ * The pool is done opening a file: cache it, even for a connection gone in
+ * the meantime, and go on with the request.
+ */
+static void connection_file_opened(struct connection *conn)
+{
+	struct file_cache *fc = &conn->loop->file_cache;
+	struct file_cache_entry *entry = NULL;
+
+	if (conn->opened != NULL)
+		entry = file_cache_add(fc, conn->opened);
+	conn->opened = NULL;
+	conn->open_pending = 0;
+
+	if (conn->state == STATE_CONNECTION_CLOSED) {
+		if (entry != NULL)
+			file_cache_put(fc, entry);
+		if (conn->aio_inflight == 0)
+			connection_remove(conn);
+		return;
+	}
+
+	if (conn->open_encoding == NULL) {
+		if (connection_use_file(conn, entry) > 0)
+			return;
+	} else {
+		/* A sibling gone since it was probed leaves the plain file. */
+		conn->request_path[conn->path_len] = '\0';
+		if (entry != NULL) {
+			file_cache_put(fc, conn->cache_entry);
+			conn->cache_entry = entry;
+			conn->encoding_header = conn->open_encoding;
+		}
+		connection_set_file(conn);
 	}
 
-	struct stat buffer;
+	connection_set_state(conn, STATE_REQUEST_RECEIVED);
+	connection_start_reply(conn);
+	connection_settle(conn);
+}
 
-	fstat(conn->fd, &buffer);
-	conn->file_size = buffer.st_size;
+/* Go on with the requests whose files the pool has opened. */
+static void aws_loop_reap_opens(struct aws_loop *loop)
+{
+	struct offload_job *job;
+	struct offload_job *next;
 
-	return -1;
+	for (job = offload_queue_take(&loop->opens_done); job != NULL; job = next) {
+		next = job->next;
+		connection_file_opened((struct connection *)
+			((char *)job - offsetof(struct connection, open_job)));
+	}
 }
 
-void connection_complete_async_io(struct connection *conn)
+#ifndef AWS_IO_URING
+void connection_complete_async_io(struct connection *conn, struct iocb *iocb, long res)
 {
 	/* TODO: Complete asynchronous operation; operation returns successfully.
 	 * Prepare socket for sending.
 	 */
-	int rc;
+	struct aws_chunk *chunk = (struct aws_chunk *)iocb;
+
+	dlog(LOG_INFO, "This is what the read returned: %ld\n", res);
 
-	memset(&(conn->iocb), 0, sizeof(conn->iocb));
-	io_prep_pwrite(&(conn->iocb), conn->sockfd, conn->send_buffer, BUFSIZ, 0);
-	conn->piocb[0] = &(conn->iocb);
-	rc = io_submit(conn->ctx, 1, conn->piocb);
-	dlog(LOG_INFO, "This is what rc is for write: %d\n", rc);
+	/* The file went away or shrank under us: the reply cannot be completed. */
+	if (res <= 0 || (size_t)res != iocb->u.c.nbytes) {
+		conn->keep_alive = 0;
+		connection_set_state(conn, STATE_DATA_SENT);
+		return;
+	}
+
+	chunk->len = res;
+	chunk->ready = 1;
+
+	/* The socket was waiting for exactly this chunk. */
+	if (conn->state == STATE_ASYNC_ONGOING &&
+	    conn->chunks[conn->chunk_head % aws_pipeline_depth].ready) {
+		connection_set_state(conn, STATE_SENDING_DATA);
+		connection_poll_out(conn);
+	}
 }
+#endif
 
+/*
+ * Parse the request at the start of recv_buffer and consume it, body
+ * included. Returns 1 once a request has been parsed, 0 if it is still
+ * incomplete and -1 if it is malformed.
+ */
 int parse_header(struct connection *conn)
 {
-	/* TODO: Parse the HTTP header and extract the file path. */
-	/* Use mostly null settings except for on_path callback. */
-	http_parser_settings settings_on_path = {
-		.on_message_begin = 0,
-		.on_header_field = 0,
-		.on_header_value = 0,
+	static const http_parser_settings settings_on_path = {
 		.on_path = aws_on_path_cb,
-		.on_url = 0,
-		.on_fragment = 0,
-		.on_query_string = 0,
-		.on_body = 0,
-		.on_headers_complete = 0,
-		.on_message_complete = 0
+		.on_header_field = aws_on_header_field_cb,
+		.on_header_value = aws_on_header_value_cb,
+		.on_headers_complete = aws_on_headers_complete_cb,
+		.on_message_complete = aws_on_message_complete_cb,
 	};
 
-	dlog(LOG_INFO, "I am in parse header: %ld\n", strlen(conn->recv_buffer));
-	http_parser_execute(&(conn->request_parser), &settings_on_path, conn->recv_buffer, strlen(conn->recv_buffer));
-	dlog(LOG_INFO, "This is the file path: %s\n", conn->request_path);
-	return 0;
+	size_t len;
+	size_t nparsed;
+	size_t request_len;
+
+	/* Only the bytes received since the last call are new to the parser. */
+	len = conn->recv_len - conn->parsed_len;
+	conn->request_parser.data = conn;
+	nparsed = http_parser_execute(&(conn->request_parser), &settings_on_path,
+				      conn->recv_buffer + conn->parsed_len, len);
+
+	if (!conn->request_done) {
+		if (nparsed != len) {
+			/* Nothing after a malformed request can be trusted. */
+			conn->recv_len = 0;
+			conn->parsed_len = 0;
+			conn->keep_alive = 0;
+			return -1;
+		}
+		/*
+		 * What the header said is kept in conn by now: drop the body
+		 * received so far, so that a large one never fills the buffer.
+		 */
+		if (conn->headers_done)
+			conn->recv_len = 0;
+		conn->parsed_len = conn->recv_len;
+		return 0;
+	}
+
+	/* The parser stops on the last byte of the request, before counting it. */
+	request_len = conn->parsed_len + nparsed + 1;
+
+	conn->keep_alive = http_should_keep_alive(&(conn->request_parser));
+
+	conn->recv_len -= request_len;
+	memmove(conn->recv_buffer, conn->recv_buffer + request_len, conn->recv_len);
+	conn->parsed_len = 0;
+
+	if (conn->path_len == 0) {
+		conn->keep_alive = 0;
+		return -1;
+	}
+
+	return 1;
 }
 
+/* Send the body of a static file, from the cache or with sendfile(2). */
 enum connection_state connection_send_static(struct connection *conn)
 {
-	/* TODO: Send static data using sendfile(2). */
-	//dlog(LOG_INFO, "This is the size of the file: %ld, and this is BUFSIZ: %ld\n", conn->file_size, BUFSIZ);
+	const char *content = connection_content(conn);
 	ssize_t bytes_sent;
-
-	bytes_sent = sendfile(conn->sockfd, conn->fd, NULL, BUFSIZ);
-	conn->send_len += bytes_sent;
-
-	if (conn->send_len >= conn->file_size) {
-		close(conn->fd);
-		conn->state = STATE_DATA_SENT;
-		return STATE_DATA_SENT;
+	off_t offset;
+
+	/* As much as the socket takes: one wakeup per socket buffer, at most. */
+	while (conn->file_pos < conn->file_end) {
+		offset = conn->file_pos;
+
+		/* Small cached files are already in memory. */
+		if (content) {
+			bytes_sent = send(conn->sockfd, content + conn->file_pos,
+					  conn->file_end - conn->file_pos, MSG_NOSIGNAL);
+			if (bytes_sent > 0)
+				offset += bytes_sent;
+		} else {
+			bytes_sent = sendfile(conn->sockfd, conn->fd, &offset,
+					      conn->file_end - conn->file_pos);
+		}
+		if (bytes_sent < 0 && errno == EAGAIN) {
+			conn->can_send = 0;
+			return STATE_SENDING_DATA;
+		}
+		/* An error, or a file cut short since it was opened. */
+		if (bytes_sent <= 0) {
+			conn->keep_alive = 0;
+			connection_set_state(conn, STATE_DATA_SENT);
+			return STATE_DATA_SENT;
+		}
+		connection_count_sent(conn, bytes_sent);
+		conn->file_pos = offset;
 	}
-	return STATE_SENDING_DATA;
+
+	connection_set_state(conn, STATE_DATA_SENT);
+	return STATE_DATA_SENT;
 }
 
 int connection_send_data(struct connection *conn)
@@ -306,93 +1998,195 @@ int connection_send_data(struct connection *conn)
 	/* TODO: Send as much data as possible from the connection send buffer.
 	 * Returns the number of bytes sent or -1 if an error occurred
 	 */
+	struct iovec iov[AWS_HEADER_IOVS + 1];
+	struct msghdr msg = { .msg_iov = iov };
+	int flags = MSG_NOSIGNAL;
+	/* A HEAD request gets the header of the reply alone. */
+	int head_only = conn->request_parser.method == HTTP_HEAD;
+	int is_static = conn->state == STATE_SENDING_HEADER && !head_only &&
+			(conn->res_type == RESOURCE_TYPE_STATIC ||
+			 conn->res_type == RESOURCE_TYPE_METRICS);
+	int with_body = 0;
 	ssize_t bytes_sent;
+	struct iovec *iov_left;
+	uint64_t now;
+	size_t n;
 
 	dlog(LOG_INFO, "Prepearing to send\n");
 
-	bytes_sent = send(conn->sockfd, conn->send_buffer, conn->send_len, 0);
-	if (bytes_sent == -1)
-		return -1;
+	msg.msg_iovlen = conn->header_iovcnt - conn->header_pos;
+	memcpy(iov, conn->header_iov + conn->header_pos, msg.msg_iovlen * sizeof(*iov));
 
-	if (bytes_sent >= conn->send_len) {
-		dlog(LOG_INFO, "Data has been sent\n");
-		conn->state = STATE_DATA_SENT;
+	/*
+	 * A small cached file goes out in the same segment as its header.
+	 * Otherwise the header is held back for the body that follows, from
+	 * sendfile() or from the file's chunks: sent on its own, it would
+	 * have the body wait for an ACK the client delays (Nagle).
+	 */
+	if (is_static && connection_content(conn)) {
+		iov[msg.msg_iovlen].iov_base = (char *)connection_content(conn) +
+					       conn->file_offset;
+		iov[msg.msg_iovlen].iov_len = conn->file_end - conn->file_offset;
+		msg.msg_iovlen++;
+		with_body = 1;
+	} else if (conn->state == STATE_SENDING_HEADER && !head_only &&
+		   conn->file_offset < conn->file_end) {
+		flags |= MSG_MORE;
+	}
 
-		if (conn->res_type == RESOURCE_TYPE_NONE) {
-			conn->state = STATE_DATA_SENT;
-			return bytes_sent;
+	bytes_sent = sendmsg(conn->sockfd, &msg, flags);
+	if (bytes_sent == -1) {
+		if (errno != EAGAIN) {
+			conn->keep_alive = 0;
+			connection_set_state(conn, STATE_DATA_SENT);
+		} else {
+			conn->can_send = 0;
 		}
-		memset(&(conn->iocb), 0, sizeof(conn->iocb));
-		conn->state = STATE_SENDING_DATA;
-		if (conn->res_type != RESOURCE_TYPE_STATIC) {
-			dlog(LOG_INFO, "Started reading from file\n");
-			conn->async_read_len = 0;
-			conn->send_len = 0;
-			conn->eventfd = eventfd(0, 0);
-			io_setup(128, &(conn->ctx));
-			w_epoll_add_fd_inout(epollfd, conn->eventfd);
-			io_set_eventfd(&(conn->iocb), conn->eventfd);
-			connection_start_async_io(conn);
-			w_epoll_update_ptr_inout(epollfd, conn->eventfd, conn);
+		return -1;
+	}
+
+	connection_count_sent(conn, bytes_sent);
+	if (!conn->first_byte_sent) {
+		now = metrics_now_usec();
+		metrics_observe(&conn->loop->metrics.first_byte, now - conn->request_start);
+		if (conn->nr_requests == 0)
+			metrics_observe(&conn->loop->metrics.conn_first_byte,
+					now - conn->accept_time);
+		conn->first_byte_sent = 1;
+	}
+
+	/* The header is out: move straight to the state of what follows. */
+	if ((size_t)bytes_sent >= conn->send_len) {
+		dlog(LOG_INFO, "Data has been sent\n");
+		conn->file_pos = conn->file_offset + bytes_sent - conn->send_len;
+		if (conn->res_type == RESOURCE_TYPE_NONE || head_only) {
+			connection_set_state(conn, STATE_DATA_SENT);
+		} else if (conn->res_type == RESOURCE_TYPE_DYNAMIC) {
+			connection_begin_async_io(conn);
+		} else if (conn->file_pos >= conn->file_end) {
+			connection_set_state(conn, STATE_DATA_SENT);
+		} else {
+			connection_set_state(conn, STATE_SENDING_DATA);
+			if (!with_body)
+				connection_send_static(conn);
 		}
 	} else {
 		dlog(LOG_INFO, "Data sent is this: %ld\n", bytes_sent);
 		conn->send_len -= bytes_sent;
-		memmove(conn->send_buffer, conn->send_buffer + bytes_sent, conn->send_len);
-		conn->send_buffer[conn->send_len] = '\0';
+
+		/* Skip the pieces sent, then what was sent of the next one. */
+		n = bytes_sent;
+		while (n >= conn->header_iov[conn->header_pos].iov_len) {
+			n -= conn->header_iov[conn->header_pos].iov_len;
+			conn->header_pos++;
+		}
+		iov_left = &conn->header_iov[conn->header_pos];
+		iov_left->iov_base = (char *)iov_left->iov_base + n;
+		iov_left->iov_len -= n;
 	}
 
 	return bytes_sent;
 }
 
 
+#ifndef AWS_IO_URING
+/*
+ * Send the chunks read asynchronously, in order, and refill the pipeline
+ * as they are sent. Returns 0 on success and -1 on error.
+ */
 int connection_send_dynamic(struct connection *conn)
 {
-	/* TODO: Read data asynchronously.
-	 * Returns 0 on success and -1 on error.
-	 */
-	struct io_event events[1];
-	ssize_t bytes_read;
-	int rc;
-
-	dlog(LOG_INFO, "Made the right decision %ld %ld\n", conn->async_read_len, conn->send_len);
+	struct aws_chunk *chunk;
+	ssize_t bytes_sent;
+	int flags;
+
+	while (conn->state == STATE_SENDING_DATA) {
+		chunk = &conn->chunks[conn->chunk_head % aws_pipeline_depth];
+		if (!chunk->ready) {
+			/* Disk is behind the network: idle until the read completes. */
+			connection_set_state(conn, STATE_ASYNC_ONGOING);
+			connection_poll_none(conn);
+			break;
+		}
 
-	rc = io_getevents(conn->ctx, 1, 1, events, NULL);
-	dlog(LOG_INFO, "This is what rc is: %d\n", rc);
-	if (rc <= 0)
-		return 0;
-	bytes_read = events[0].res;
+		/* Hold the tail of the chunk back only for a next one already read. */
+		flags = MSG_NOSIGNAL;
+		if (conn->chunk_tail - conn->chunk_head > 1 &&
+		    conn->chunks[(conn->chunk_head + 1) % aws_pipeline_depth].ready)
+			flags |= MSG_MORE;
+
+		bytes_sent = send(conn->sockfd, chunk->buf + conn->send_pos,
+				  chunk->len - conn->send_pos, flags);
+		if (bytes_sent < 0) {
+			if (errno == EAGAIN) {
+				conn->can_send = 0;
+				return 0;
+			}
+			conn->keep_alive = 0;
+			connection_set_state(conn, STATE_DATA_SENT);
+			return -1;
+		}
 
-	if (conn->send_len == conn->async_read_len) {
-		conn->async_read_len += bytes_read;
-		dlog(LOG_INFO, "I have read this much from file: %ld\n", conn->async_read_len);
-		connection_complete_async_io(conn);
-	} else {
-		conn->send_len += bytes_read;
-		conn->async_read_len = conn->send_len;
+		connection_count_sent(conn, bytes_sent);
+		conn->send_pos += bytes_sent;
+		if (conn->send_pos < chunk->len)
+			return 0;
+
+		conn->async_read_len += chunk->len;
+		conn->send_pos = 0;
+		chunk->ready = 0;
+		buf_pool_put(&conn->loop->chunk_pool, chunk->buf);
+		chunk->buf = NULL;
+		conn->chunk_head++;
 		dlog(LOG_INFO, "I have sent this much from file: %ld\n", conn->async_read_len);
-		if (conn->async_read_len >= conn->file_size) {
-			conn->state = STATE_DATA_SENT;
-			w_epoll_remove_ptr(epollfd, conn->eventfd, conn);
-			io_destroy(conn->ctx);
-			close(conn->eventfd);
-		} else {
+
+		if (conn->async_read_len >= conn->file_end)
+			connection_set_state(conn, STATE_DATA_SENT);
+		else
 			connection_start_async_io(conn);
-		}
 	}
 
-	dlog(LOG_INFO, "I WILL NOW EXIT CONNECTION_SEND_DYNAMIC WITH THE CODE: %d\n", conn->state);
 	return 0;
 }
+#endif
 
 
-void handle_input(struct connection *conn)
+/*
+ * Act on a connection that is done with its reply or with the peer. Called
+ * once the current event or completion has been handled.
+ */
+static void connection_settle(struct connection *conn)
 {
-	/* TODO: Handle input information: may be a new message or notification of
-	 * completion of an asynchronous I/O operation.
-	 */
-	dlog(LOG_INFO, "I AM IN HANDLE INPUT: %d\n", conn->state);
+	for (;;) {
+		/* A finished reply may also complete a pipelined request. */
+		if (conn->state == STATE_DATA_SENT) {
+			connection_finish_request(conn);
+			continue;
+		}
+		if (conn->state == STATE_CONNECTION_CLOSED) {
+			connection_remove(conn);
+			return;
+		}
+		if (!aws_edge_triggered)
+			return;
 
+		/*
+		 * An edge is only reported once: keep going until the socket
+		 * runs dry (EAGAIN) in the direction the connection needs.
+		 */
+		if ((conn->state == STATE_INITIAL ||
+		     conn->state == STATE_RECEIVING_DATA) && conn->can_recv)
+			handle_input(conn);
+		else if (OUT_STATE(conn->state) && conn->can_send)
+			handle_output(conn);
+		else
+			return;
+	}
+}
+
+/* The socket has data, or an end, for a connection waiting for a request. */
+void handle_input(struct connection *conn)
+{
 	switch (conn->state) {
 	case STATE_INITIAL:
 		receive_data(conn);
@@ -400,21 +2194,16 @@ void handle_input(struct connection *conn)
 	case STATE_RECEIVING_DATA:
 		receive_data(conn);
 		break;
-	case STATE_SENDING_DATA:
-		connection_send_dynamic(conn);
-		break;
 	default:
-		printf("shouldn't get here %d\n", conn->state);
+		/* Only waiting for a request polls for input. */
+		dlog(LOG_ERR, "Input in unexpected state %s\n", aws_state_names[conn->state]);
+		connection_set_state(conn, STATE_CONNECTION_CLOSED);
 	}
 }
 
+/* The socket has room for the reply being sent. */
 void handle_output(struct connection *conn)
 {
-	/* TODO: Handle output information: may be a new valid requests or notification of
-	 * completion of an asynchronous I/O operation or invalid requests.
-	 */
-	dlog(LOG_INFO, "I AM IN HANDLE OUTPUT: %d\n", conn->state);
-
 	switch (conn->state) {
 	case STATE_SENDING_404:
 		connection_send_data(conn);
@@ -422,15 +2211,16 @@ void handle_output(struct connection *conn)
 	case STATE_SENDING_HEADER:
 		connection_send_data(conn);
 		break;
-	case STATE_DATA_SENT:
-		w_epoll_remove_ptr(epollfd, conn->sockfd, conn);
-		connection_remove(conn);
-		break;
 	case STATE_SENDING_DATA:
-		if (conn->res_type == RESOURCE_TYPE_STATIC)
+		if (conn->res_type != RESOURCE_TYPE_DYNAMIC)
 			connection_send_static(conn);
+#ifdef AWS_IO_URING
+		else
+			connection_send_spliced(conn);
+#else
 		else
 			connection_send_dynamic(conn);
+#endif
 		break;
 	default:
 		ERR("Unexpected state\n");
@@ -438,57 +2228,565 @@ void handle_output(struct connection *conn)
 	}
 }
 
+/* Dispatch the events of a connection, then run it as far as it goes. */
 void handle_client(uint32_t event, struct connection *conn)
 {
-	/* TODO: Handle new client. There can be input and output connections.
-	 * Take care of what happened at the end of a connection.
-	 */
+	if (conn->state == STATE_CONNECTION_CLOSED)
+		return;
+
+	if (aws_edge_triggered) {
+		/* Errors and hangups are reported by the next recv()/send(). */
+		if (event & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			conn->can_recv = 1;
+		if (event & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+			conn->can_send = 1;
+	} else {
+		if (event & EPOLLIN)
+			handle_input(conn);
+		if ((event & EPOLLOUT) && OUT_STATE(conn->state))
+			handle_output(conn);
+	}
+
+	/* Peer went away while the transfer or the open is out of our hands. */
+	if ((event & (EPOLLERR | EPOLLHUP)) &&
+	    (conn->state == STATE_ASYNC_ONGOING || conn->state == STATE_OPENING_FILE))
+		connection_set_state(conn, STATE_CONNECTION_CLOSED);
+
+	connection_settle(conn);
+}
+
+#ifdef AWS_IO_URING
+/* Handle the completion of one of the requests of a dynamic transfer. */
+static void connection_complete_uring_op(struct aws_uring_op *op, int res)
+{
+	struct connection *conn = op->conn;
+
+	conn->aio_inflight--;
+	metrics_add(&conn->loop->metrics.async_inflight, -1);
+	if (conn->state == STATE_CONNECTION_CLOSED) {
+		if (conn->aio_inflight == 0)
+			connection_remove(conn);
+		return;
+	}
+
+	/* Spliced transfers only ever have their read in flight. */
+	if (conn->pipe.rd >= 0) {
+		connection_complete_splice(conn, res);
+		connection_settle(conn);
+		return;
+	}
+
+	if (!op->is_send) {
+		/* A short read breaks the link and the send gets cancelled. */
+		conn->read_pending = 0;
+		if (res <= 0)
+			conn->read_failed = 1;
+		else if ((size_t)res < conn->chunk_len)
+			conn->chunk_len = res;
+	} else if (res == -ECANCELED) {
+		conn->send_cancelled = 1;
+	} else if (res == -EAGAIN || res == -EINTR) {
+		connection_queue_send(conn);
+		return;
+	} else if (res < 0) {
+		conn->keep_alive = 0;
+		connection_set_state(conn, STATE_DATA_SENT);
+	} else {
+		connection_count_sent(conn, res);
+		conn->send_pos += res;
+		if (conn->send_pos < conn->chunk_len) {
+			connection_queue_send(conn);
+			return;
+		}
+
+		conn->async_read_len += conn->chunk_len;
+		if (conn->async_read_len < conn->file_end) {
+			connection_start_async_io(conn);
+			return;
+		}
+
+		connection_put_io_buffer(conn);
+		connection_set_state(conn, STATE_DATA_SENT);
+	}
+
+	/* Resend what a short read did get, once both sides have completed. */
+	if (conn->send_cancelled && !conn->read_pending) {
+		conn->send_cancelled = 0;
+		if (conn->read_failed) {
+			conn->keep_alive = 0;
+			connection_set_state(conn, STATE_DATA_SENT);
+		} else {
+			connection_queue_send(conn);
+		}
+	}
+
+	connection_settle(conn);
+}
+
+/* Run the completions posted on the loop's ring. */
+static void aws_loop_reap_ring(struct aws_loop *loop)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	unsigned int nr = 0;
+	uint64_t count;
+
+	/* The counter only wakes us up; the CQ ring tells what completed. */
+	if (read(loop->ring_eventfd, &count, sizeof(count)) < 0)
+		DIE(errno != EAGAIN, "read eventfd");
+
+	io_uring_for_each_cqe(&loop->ring, head, cqe) {
+		connection_complete_uring_op(io_uring_cqe_get_data(cqe), cqe->res);
+		nr++;
+	}
+	io_uring_cq_advance(&loop->ring, nr);
+}
+
+static void aws_loop_init_ring(struct aws_loop *loop)
+{
+	struct iovec iov[AWS_URING_BUFFERS];
+	int rc;
+	int i;
+
+	rc = io_uring_queue_init(AWS_URING_ENTRIES, &loop->ring, 0);
+	DIE(rc < 0, "io_uring_queue_init");
+
+	loop->ring_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	DIE(loop->ring_eventfd < 0, "eventfd");
+	rc = io_uring_register_eventfd(&loop->ring, loop->ring_eventfd);
+	DIE(rc < 0, "io_uring_register_eventfd");
+	rc = w_epoll_add_ptr_in(loop->epollfd, loop->ring_eventfd, &loop->ring_eventfd);
+	DIE(rc < 0, "w_epoll_add_ptr_in");
+
+	loop->ring_buffers = aligned_alloc(4096, AWS_URING_BUFFERS * aws_chunk_size);
+	DIE(loop->ring_buffers == NULL, "aligned_alloc");
+	for (i = 0; i < AWS_URING_BUFFERS; i++) {
+		iov[i].iov_base = loop->ring_buffers + i * aws_chunk_size;
+		iov[i].iov_len = aws_chunk_size;
+	}
+
+	/* Registration may hit RLIMIT_MEMLOCK: transfers then malloc() buffers. */
+	if (io_uring_register_buffers(&loop->ring, iov, AWS_URING_BUFFERS) < 0) {
+		dlog(LOG_WARNING, "Loop %d runs without registered buffers\n", loop->id);
+		free(loop->ring_buffers);
+		loop->ring_buffers = NULL;
+		loop->nr_free_buffers = 0;
+		return;
+	}
+
+	for (i = 0; i < AWS_URING_BUFFERS; i++)
+		loop->free_buffers[i] = AWS_URING_BUFFERS - 1 - i;
+	loop->nr_free_buffers = AWS_URING_BUFFERS;
+}
+#else
+/* Run the completions of the loop's AIO context, in batches. */
+static void aws_loop_reap_aio(struct aws_loop *loop)
+{
+	static const struct timespec no_wait;
+	struct io_event events[AWS_AIO_BATCH];
+	struct connection *conn;
+	uint64_t count;
+	int rc;
+	int i;
+
+	/* The counter only wakes us up; io_getevents() tells what completed. */
+	if (read(loop->aio_eventfd, &count, sizeof(count)) < 0)
+		DIE(errno != EAGAIN, "read eventfd");
+
+	do {
+		rc = io_getevents(loop->aio_ctx, 0, AWS_AIO_BATCH, events,
+				  (struct timespec *)&no_wait);
+		DIE(rc < 0, "io_getevents");
+
+		for (i = 0; i < rc; i++) {
+			conn = events[i].data;
+			conn->aio_inflight--;
+			metrics_add(&loop->metrics.async_inflight, -1);
+			if (conn->state == STATE_CONNECTION_CLOSED) {
+				if (conn->aio_inflight == 0)
+					connection_remove(conn);
+				continue;
+			}
+
+			connection_complete_async_io(conn, events[i].obj, events[i].res);
+			connection_settle(conn);
+		}
+	} while (rc == AWS_AIO_BATCH);
+}
+
+static void aws_loop_init_aio(struct aws_loop *loop)
+{
+	int rc;
+
+	loop->aio_ctx = 0;
+	loop->aio_full = 0;
+	rc = io_setup(AWS_AIO_MAX_EVENTS, &loop->aio_ctx);
+	DIE(rc < 0, "io_setup");
+
+	loop->aio_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	DIE(loop->aio_eventfd < 0, "eventfd");
+	rc = w_epoll_add_ptr_in(loop->epollfd, loop->aio_eventfd, &loop->aio_eventfd);
+	DIE(rc < 0, "w_epoll_add_ptr_in");
+}
+#endif
+
+static uint64_t aws_loop_tick(void)
+{
+	return metrics_now_usec() / (AWS_TIMER_TICK_MS * 1000);
 }
 
-int main(void)
+void aws_loop_init(struct aws_loop *loop, int id)
 {
 	int rc;
 
-	/* TODO: Initialize asynchronous operations. */
+	loop->id = id;
+	metrics_register(&loop->metrics);
+	timer_wheel_init(&loop->timers, aws_loop_tick());
+	timer_init(&loop->accept_timer, aws_loop_accept_retry);
+	loop->accept_ready = 0;
+	loop->accept_paused = 0;
+	loop->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	DIE(loop->spare_fd < 0, "open");
+
+	file_cache_init(&loop->file_cache, FILE_CACHE_MAX_ENTRIES,
+			FILE_CACHE_MAX_BYTES);
+
+	slab_cache_init(&loop->conn_cache, sizeof(struct connection),
+			AWS_CONN_SLAB_OBJS);
+	buf_pool_init(&loop->recv_pool, BUFSIZ, AWS_POOL_MAX_FREE, NULL);
+	buf_pool_init(&loop->chunk_pool, aws_chunk_size, AWS_POOL_MAX_FREE,
+		      &aws_io_budget);
+	loop->buf_waiters = NULL;
+	loop->buf_waiters_tail = &loop->buf_waiters;
+#ifndef AWS_IO_URING
+	slab_cache_init(&loop->chunks_cache,
+			aws_pipeline_depth * sizeof(struct aws_chunk),
+			AWS_CONN_SLAB_OBJS);
+#endif
 
 	/* TODO: Initialize multiplexing. */
-	epollfd = w_epoll_create();
-	DIE(epollfd < 0, "w_epoll_create");
+	loop->epollfd = w_epoll_create();
+	DIE(loop->epollfd < 0, "w_epoll_create");
 
 	/* TODO: Create server socket. */
-	listenfd = tcp_create_listener(AWS_LISTEN_PORT,
-		DEFAULT_LISTEN_BACKLOG);
-	DIE(listenfd < 0, "tcp_create_listener");
+	loop->listenfd = tcp_create_reuseport_listener(AWS_LISTEN_PORT,
+		AWS_LISTEN_BACKLOG);
+	DIE(loop->listenfd < 0, "tcp_create_reuseport_listener");
+
+	/*
+	 * Add the server socket to the epoll object. Loop-level fds are tagged
+	 * with a pointer into the loop, as connections are, so the two can
+	 * never be confused.
+	 */
+	rc = fcntl(loop->listenfd, F_SETFL, fcntl(loop->listenfd, F_GETFL) | O_NONBLOCK);
+	DIE(rc < 0, "fcntl");
+	if (aws_edge_triggered)
+		rc = w_epoll_add_ptr_in_et(loop->epollfd, loop->listenfd, &loop->listenfd);
+	else
+		rc = w_epoll_add_ptr_in(loop->epollfd, loop->listenfd, &loop->listenfd);
+	DIE(rc < 0, "w_epoll_add_ptr_in");
+
+#ifdef AWS_IO_URING
+	aws_loop_init_ring(loop);
+#else
+	aws_loop_init_aio(loop);
+#endif
+
+	if (loop->file_cache.inotify_fd >= 0) {
+		rc = w_epoll_add_ptr_in(loop->epollfd, loop->file_cache.inotify_fd,
+					&loop->file_cache.inotify_fd);
+		DIE(rc < 0, "w_epoll_add_ptr_in");
+	}
+
+	if (aws_open_threads > 0) {
+		offload_queue_init(&loop->opens_done);
+		rc = w_epoll_add_ptr_in(loop->epollfd, loop->opens_done.eventfd,
+					&loop->opens_done);
+		DIE(rc < 0, "w_epoll_add_ptr_in");
+	}
+}
+
+/* Free the connections closed while handling the last batch of events. */
+static void aws_loop_free_closed(struct aws_loop *loop)
+{
+	struct connection *conn;
+
+	while (loop->closed != NULL) {
+		conn = loop->closed;
+		loop->closed = conn->closed_next;
+		metrics_add(&loop->metrics.states[conn->state], -1);
+		slab_cache_free(&loop->conn_cache, conn);
+	}
 
-	/* TODO: Add server socket to epoll object*/
-	rc = w_epoll_add_fd_in(epollfd, listenfd);
-	DIE(rc < 0, "w_epoll_add_fd_in");
+	aws_loop_resume_accept(loop);
+}
+
+void *aws_loop_run(void *arg)
+{
+	struct aws_loop *loop = arg;
+	struct epoll_event revs[AWS_EPOLL_BATCH];
+	struct epoll_event *rev;
+	int timeout;
+	int rc;
+	int i;
 
 	/* Uncomment the following line for debugging. */
-	dlog(LOG_INFO, "Server waiting for connections on port %d\n", AWS_LISTEN_PORT);
+	dlog(LOG_INFO, "Loop %d waiting for connections on port %d\n",
+		loop->id, AWS_LISTEN_PORT);
 
 	/* server main loop */
 	while (1) {
-		struct epoll_event rev;
+#ifdef AWS_IO_URING
+		/* Submit everything queued while handling the last events at once. */
+		if (io_uring_sq_ready(&loop->ring) > 0)
+			io_uring_submit(&loop->ring);
+#endif
+
+		/*
+		 * Wait for events. Wake up every tick while timers run or
+		 * transfers wait for buffers, don't block while connections
+		 * are left to accept.
+		 */
+		if (loop->accept_ready && !loop->accept_paused)
+			timeout = 0;
+		else if (loop->timers.nr_timers > 0 || loop->buf_waiters != NULL)
+			timeout = AWS_TIMER_TICK_MS;
+		else
+			timeout = EPOLL_TIMEOUT_INFINITE;
+		rc = w_epoll_wait_batch(loop->epollfd, revs, AWS_EPOLL_BATCH, timeout);
+		/* io_uring task work may interrupt the wait, as a signal would. */
+		if (rc < 0 && errno == EINTR)
+			continue;
+		DIE(rc < 0, "w_epoll_wait_batch");
+
+		/*
+		 * Expire first, so timers armed while handling the events
+		 * count from the current tick. Events left for connections
+		 * dropped here are ignored.
+		 */
+		timer_wheel_advance(&loop->timers, aws_loop_tick());
+
+		/* Loop-level fds first, by their tag; connections otherwise. */
+		for (i = 0; i < rc; i++) {
+			rev = &revs[i];
+			if (rev->data.ptr == &loop->listenfd) {
+				if (rev->events & EPOLLIN)
+					loop->accept_ready = 1;
+#ifdef AWS_IO_URING
+			} else if (rev->data.ptr == &loop->ring_eventfd) {
+				aws_loop_reap_ring(loop);
+#else
+			} else if (rev->data.ptr == &loop->aio_eventfd) {
+				aws_loop_reap_aio(loop);
+#endif
+			} else if (rev->data.ptr == &loop->file_cache.inotify_fd) {
+				file_cache_handle_events(&loop->file_cache);
+			} else if (rev->data.ptr == &loop->opens_done) {
+				aws_loop_reap_opens(loop);
+			} else {
+				handle_client(rev->events, rev->data.ptr);
+			}
+		}
 
-		/* TODO: Wait for events. */
-		rc = w_epoll_wait_infinite(epollfd, &rev);
-		DIE(rc < 0, "w_epoll_wait_infinite");
+		/* Connections being served come first, new ones after. */
+		if (loop->accept_ready && !loop->accept_paused)
+			handle_new_connection(loop);
 
-		/* TODO: Switch event types; consider
-		 *   - new connection requests (on server socket)
-		 *   - socket communication (on connection sockets)
-		 */
-		if (rev.data.fd == listenfd) {
-			if (rev.events & EPOLLIN)
-				handle_new_connection();
-		} else {
-			if (rev.events & EPOLLIN)
-				handle_input(rev.data.ptr);
-			if (rev.events & EPOLLOUT)
-				handle_output(rev.data.ptr);
+		if (loop->buf_waiters != NULL)
+			aws_loop_wake_buffer_waiters(loop);
+
+		aws_loop_free_closed(loop);
+	}
+
+	return NULL;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-w workers] [-c chunk] [-d depth] [-e] [-a access_log]\n"
+		"          [-t header_timeout] [-k idle_timeout] [-s send_timeout] [-m conns]\n"
+		"          [-b budget] [-o threads] [-z]\n"
+		"  -w workers   number of event loops, 1..%d (default %d)\n"
+		"  -c chunk     dynamic file read size in bytes, 4096..%d (default %d)\n"
+		"  -d depth     dynamic file reads in flight, 1..%d (default %d)\n"
+		"  -e           edge-triggered sockets, drained until EAGAIN\n"
+		"  -a file      append a line per request served to file\n"
+		"  -t seconds   time allowed to receive a request (default %d)\n"
+		"  -k seconds   time a persistent connection may stay idle (default %d)\n"
+		"  -s seconds   time a reply may make no progress (default %d)\n"
+		"               timeouts are 0 (never) to %d seconds\n"
+		"  -m conns     connections served at once, over all loops\n"
+		"               (default: as many as the open files limit allows)\n"
+		"  -b MiB       dynamic file buffers in use at once, over all loops,\n"
+		"               at least one chunk (default %d)\n"
+		"  -o threads   threads opening files missing from the caches,\n"
+		"               0..%d, 0 to open them on the loops (default %d)\n"
+		"  -z           splice dynamic files to sockets through pipes\n"
+		"               (io_uring engine only)\n",
+		argv0, AWS_MAX_WORKERS, AWS_DEFAULT_WORKERS,
+		AWS_MAX_CHUNK, AWS_DYNAMIC_CHUNK, AWS_MAX_DEPTH, AWS_DYNAMIC_DEPTH,
+		AWS_HEADER_TIMEOUT, AWS_IDLE_TIMEOUT, AWS_SEND_TIMEOUT, AWS_MAX_TIMEOUT,
+		AWS_IO_BUDGET_MB, AWS_MAX_OPEN_THREADS, AWS_OPEN_THREADS);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Raise the open files limit as far as allowed and size the connection
+ * budget to it: a connection may hold a socket and a file.
+ */
+static long aws_default_max_conns(void)
+{
+	struct rlimit rl;
+	int rc;
+
+	rc = getrlimit(RLIMIT_NOFILE, &rl);
+	DIE(rc < 0, "getrlimit");
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+			getrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	if (rl.rlim_cur <= 2 * AWS_RESERVED_FDS)
+		return 1;
+	if (rl.rlim_cur > INT_MAX)
+		return INT_MAX / 2;
+
+	return (rl.rlim_cur - AWS_RESERVED_FDS) / 2;
+}
+
+static unsigned int parse_timeout(const char *argv0, const char *arg)
+{
+	int seconds = atoi(arg);
+
+	if (seconds < 0 || seconds > AWS_MAX_TIMEOUT)
+		usage(argv0);
+
+	return seconds;
+}
+
+int main(int argc, char *argv[])
+{
+	struct aws_loop *loops;
+	int nr_workers = AWS_DEFAULT_WORKERS;
+	int access_fd = -1;
+	long max_conns = 0;
+	long budget_mb = AWS_IO_BUDGET_MB;
+	int open_threads;
+	int opt;
+	int rc;
+	int i;
+
+	while ((opt = getopt(argc, argv, "w:c:d:ea:t:k:s:m:b:o:z")) != -1) {
+		switch (opt) {
+		case 'w':
+			nr_workers = atoi(optarg);
+			if (nr_workers < 1 || nr_workers > AWS_MAX_WORKERS)
+				usage(argv[0]);
+			break;
+		case 'c':
+			aws_chunk_size = atoi(optarg);
+			if (aws_chunk_size < 4096 || aws_chunk_size > AWS_MAX_CHUNK ||
+			    aws_chunk_size % 4096)
+				usage(argv[0]);
+			break;
+		case 'd':
+			aws_pipeline_depth = atoi(optarg);
+			if (aws_pipeline_depth < 1 || aws_pipeline_depth > AWS_MAX_DEPTH)
+				usage(argv[0]);
+			break;
+		case 'e':
+			aws_edge_triggered = 1;
+			break;
+		case 'a':
+			access_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+			DIE(access_fd < 0, optarg);
+			break;
+		case 't':
+			aws_header_timeout = parse_timeout(argv[0], optarg);
+			break;
+		case 'k':
+			aws_idle_timeout = parse_timeout(argv[0], optarg);
+			break;
+		case 's':
+			aws_send_timeout = parse_timeout(argv[0], optarg);
+			break;
+		case 'm':
+			max_conns = atoi(optarg);
+			if (max_conns < 1)
+				usage(argv[0]);
+			break;
+		case 'b':
+			budget_mb = atoi(optarg);
+			if (budget_mb < 1 || budget_mb > AWS_MAX_IO_BUDGET_MB)
+				usage(argv[0]);
+			break;
+		case 'o':
+			open_threads = atoi(optarg);
+			if (open_threads < 0 || open_threads > AWS_MAX_OPEN_THREADS)
+				usage(argv[0]);
+			aws_open_threads = open_threads;
+			break;
+#ifdef AWS_IO_URING
+		case 'z':
+			aws_splice = 1;
+			break;
+#endif
+		default:
+			usage(argv[0]);
 		}
 	}
 
+	/*
+	 * A loop's file cache needs an inotify instance of its own, and
+	 * fs.inotify.max_user_instances is 128 by default: loops past the
+	 * limit would serve every file uncached, so they are not started.
+	 */
+	rc = file_cache_nr_watchable(nr_workers);
+	if (rc > 0 && rc < nr_workers) {
+		fprintf(stderr, "%s: only %d inotify instances available, running %d loops instead of %d\n",
+			argv[0], rc, rc, nr_workers);
+		nr_workers = rc;
+	}
+
+	if (max_conns == 0)
+		max_conns = aws_default_max_conns();
+	aws_max_conns = (max_conns + nr_workers - 1) / nr_workers;
+
+	/* A budget smaller than a chunk would never let a transfer start. */
+	if ((size_t)budget_mb * 1024 * 1024 < aws_chunk_size)
+		usage(argv[0]);
+	buf_budget_init(&aws_io_budget, (size_t)budget_mb * 1024 * 1024);
+
+	route_table_init(&aws_route_table, aws_routes,
+			 sizeof(aws_routes) / sizeof(aws_routes[0]));
+
+	/* Peers going away mid-reply must not kill the server. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Records are written out by a thread of their own, off the loops. */
+	log_init(STDERR_FILENO, access_fd);
+
+	/* Files missing from the loops' caches are opened by a pool of threads. */
+	offload_pool_init(&aws_open_pool, aws_open_threads);
+
+	/* Set up every loop before serving so bind errors are fatal early. */
+	loops = calloc(nr_workers, sizeof(*loops));
+	DIE(loops == NULL, "calloc");
+
+	for (i = 0; i < nr_workers; i++)
+		aws_loop_init(&loops[i], i);
+
+	dlog(LOG_INFO, "Server waiting for connections on port %d with %d loops\n",
+		AWS_LISTEN_PORT, nr_workers);
+
+	/* Loop 0 runs on the main thread, every other loop gets its own. */
+	for (i = 1; i < nr_workers; i++) {
+		rc = pthread_create(&loops[i].thread, NULL, aws_loop_run, &loops[i]);
+		DIE(rc != 0, "pthread_create");
+	}
+
+	aws_loop_run(&loops[0]);
+
 	return 0;
 }
@@ -3,7 +3,22 @@
 #ifndef AWS_H_
 #define AWS_H_		1
 
+#ifdef AWS_IO_URING
+#include <liburing.h>
+#else
+#include <libaio.h>
+#endif
+
+#include <netinet/in.h>
+#include <sys/uio.h>
+
 #include "http-parser/http_parser.h"
+#include "file_cache.h"
+#include "mem_pool.h"
+#include "metrics.h"
+#include "offload.h"
+#include "route.h"
+#include "timer_wheel.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,10 +31,143 @@ extern "C" {
 #define AWS_ABS_STATIC_FOLDER	(AWS_DOCUMENT_ROOT AWS_REL_STATIC_FOLDER)
 #define AWS_ABS_DYNAMIC_FOLDER	(AWS_DOCUMENT_ROOT AWS_REL_DYNAMIC_FOLDER)
 
+/* reserved path serving the metrics in the Prometheus text format */
+#define AWS_METRICS_PATH	"metrics"
+
+/* Number of event loops (reactors) started when -w is not given */
+#define AWS_DEFAULT_WORKERS	1
+#define AWS_MAX_WORKERS		256
+
+/* events handled per epoll_wait() call */
+#define AWS_EPOLL_BATCH		256
+
+/*
+ * Dynamic files are read in chunks of aws_chunk_size bytes (a multiple of
+ * the page size), with up to aws_pipeline_depth reads in flight per
+ * transfer (-c and -d options; io_uring keeps one linked read and send).
+ */
+#define AWS_DYNAMIC_CHUNK	(64 * 1024)
+#define AWS_DYNAMIC_DEPTH	4
+#define AWS_MAX_CHUNK		(16 * 1024 * 1024)
+#define AWS_MAX_DEPTH		64
+
+extern size_t aws_chunk_size;
+extern int aws_pipeline_depth;
+
+#ifdef AWS_IO_URING
+/*
+ * -z: dynamic files are spliced into a pipe by the ring and from there
+ * into the socket by the loop, never copied through user memory. Each
+ * transfer holds a pipe of its own, of about a chunk, while it runs.
+ */
+extern int aws_splice;
+#endif
+
+/*
+ * Bytes of chunk buffers lent out at once by all the loops together (-b
+ * option, in MiB). Each chunk is handed back as soon as it has been sent;
+ * a transfer finding the budget spent waits with nothing in flight until
+ * one is. Registered io_uring buffers are set aside up front, not counted.
+ */
+#define AWS_IO_BUDGET_MB	64
+#define AWS_MAX_IO_BUDGET_MB	(1024 * 1024)
+
+extern struct buf_budget aws_io_budget;
+
+/* -e: sockets are edge-triggered and drained until EAGAIN */
+extern int aws_edge_triggered;
+
+/*
+ * Seconds before a connection is dropped (-t, -k and -s options, 0 for
+ * never): a request not fully received since it started or since the
+ * connection was accepted, a persistent connection idle between requests,
+ * a reply making no progress. Timers are checked every AWS_TIMER_TICK_MS.
+ */
+#define AWS_HEADER_TIMEOUT	20
+#define AWS_IDLE_TIMEOUT	60
+#define AWS_SEND_TIMEOUT	60
+#define AWS_MAX_TIMEOUT		86400
+#define AWS_TIMER_TICK_MS	100
+
+extern unsigned int aws_header_timeout;
+extern unsigned int aws_idle_timeout;
+extern unsigned int aws_send_timeout;
+
+/*
+ * Admission control: a loop stops watching its listener while it holds
+ * aws_max_conns connections (-m option, spread over the loops). By default
+ * that is what RLIMIT_NOFILE allows at two fds per connection, less
+ * AWS_RESERVED_FDS. New connections are accepted after the events of the
+ * existing ones, at most AWS_ACCEPT_BATCH per round; the others wait in
+ * the listen backlog.
+ */
+#define AWS_RESERVED_FDS	64
+#define AWS_LISTEN_BACKLOG	4096	/* capped by net.core.somaxconn */
+#define AWS_ACCEPT_BATCH	64
+
+/* listener pause after running out of fds */
+#define AWS_ACCEPT_RETRY_MS	100
+
+extern unsigned int aws_max_conns;
+
+/*
+ * Files missing from a loop's cache are opened, and stat()ed, by a pool
+ * of aws_open_threads threads shared by the loops (-o option, 0 to open
+ * them on the loops), so that a slow lookup only holds up its request.
+ */
+#define AWS_OPEN_THREADS	4
+#define AWS_MAX_OPEN_THREADS	64
+
+extern unsigned int aws_open_threads;
+extern struct offload_pool aws_open_pool;
+
+/*
+ * Connections keep small buffers inline; a request outgrowing recv_inline
+ * borrows a BUFSIZ buffer from the loop's pool until it has been served.
+ */
+#define AWS_RECV_INLINE		512
+#define AWS_PATH_MAX		256
+
+/*
+ * Reply headers are gathered from up to AWS_HEADER_IOVS pieces, only the
+ * variable ones being written, into AWS_HEADER_AREA bytes of the connection.
+ */
+#define AWS_HEADER_IOVS		8
+#define AWS_HEADER_AREA		192
+
+/* request headers acted upon are kept up to this size, names included */
+#define AWS_HEADER_NAME_MAX	32
+#define AWS_HEADER_VALUE_MAX	64
+
+/* connections per slab and idle pool buffers kept by each loop */
+#define AWS_CONN_SLAB_OBJS	64
+#define AWS_POOL_MAX_FREE	128
+
+#ifdef AWS_IO_URING
+/* Per-loop io_uring: submission queue size and registered chunk buffers */
+#define AWS_URING_ENTRIES	256
+#define AWS_URING_BUFFERS	64
+
+/* idle pipes kept by each loop for spliced transfers */
+#define AWS_URING_PIPES		64
+
+/* Pipe a spliced transfer moves the file through */
+struct aws_pipe {
+	int rd;			/* -1 when the transfer has none */
+	int wr;
+	size_t size;		/* capacity, bytes spliced in at once at most */
+};
+#else
+/* Per-loop libaio context size and completions reaped per io_getevents() */
+#define AWS_AIO_MAX_EVENTS	1024
+#define AWS_AIO_BATCH		64
+#endif
+
 enum connection_state {
 	STATE_INITIAL,
 	STATE_RECEIVING_DATA,
 	STATE_REQUEST_RECEIVED,
+	STATE_OPENING_FILE,
 	STATE_SENDING_DATA,
 	STATE_SENDING_HEADER,
 	STATE_SENDING_404,
@@ -34,68 +182,267 @@ enum connection_state {
 #define OUT_STATE(s) (((s) == STATE_SENDING_DATA) ||	\
 	((s) == STATE_SENDING_HEADER) || ((s) == STATE_SENDING_404))
 
-/* Resource type request by HTTP (either static or dynamic) */
+/* Resource type request by HTTP (static, dynamic or the metrics) */
 enum resource_type {
 	RESOURCE_TYPE_NONE,
 	RESOURCE_TYPE_STATIC,
-	RESOURCE_TYPE_DYNAMIC
+	RESOURCE_TYPE_DYNAMIC,
+	RESOURCE_TYPE_METRICS	/* generated, sent like a static file */
+};
+
+/*
+ * Event loop owned by one worker thread. Every loop has its own epoll
+ * instance and its own SO_REUSEPORT listener, so connections accepted by a
+ * loop are only ever touched by that loop's thread.
+ */
+struct aws_loop {
+	int id;
+	int epollfd;
+	int listenfd;
+	pthread_t thread;
+
+	/* open static files, shared by the loop's connections */
+	struct file_cache file_cache;
+
+	/* connection objects, and large buffers lent to them while in use */
+	struct slab_cache conn_cache;
+	struct connection *closed;	/* freed once the current batch is done */
+	struct buf_pool recv_pool;
+	struct buf_pool chunk_pool;
+
+	/* dynamic transfers waiting for chunk_pool to be under budget again */
+	struct connection *buf_waiters;
+	struct connection **buf_waiters_tail;
+
+	struct metrics metrics;
+
+	/* connection timeouts, in AWS_TIMER_TICK_MS ticks */
+	struct timer_wheel timers;
+
+	/* connections may be waiting on the listener */
+	int accept_ready;
+
+	/* listener out of the epoll set, over budget or out of fds */
+	int accept_paused;
+	struct timer accept_timer;
+
+	/* open on /dev/null, given up to turn a connection away when out of fds */
+	int spare_fd;
+
+	/* files opened for the loop's connections by aws_open_pool */
+	struct offload_queue opens_done;
+
+#ifdef AWS_IO_URING
+	/* ring shared by the loop's dynamic transfers, completions signal eventfd */
+	struct io_uring ring;
+	int ring_eventfd;
+
+	/* registered buffers; free_buffers is a stack of unused indexes */
+	char *ring_buffers;
+	int free_buffers[AWS_URING_BUFFERS];
+	int nr_free_buffers;
+
+	/* empty pipes left by spliced transfers */
+	struct aws_pipe free_pipes[AWS_URING_PIPES];
+	int nr_free_pipes;
+#else
+	/* context shared by the loop's dynamic transfers, completions signal eventfd */
+	io_context_t aio_ctx;
+	int aio_eventfd;
+	int aio_full;		/* a submission was turned down since the last wakeup */
+
+	/* pipeline chunk arrays, aws_pipeline_depth entries each */
+	struct slab_cache chunks_cache;
+#endif
+};
+
+#ifdef AWS_IO_URING
+/* user_data of an io_uring request, routing its completion back */
+struct aws_uring_op {
+	struct connection *conn;
+	int is_send;
+};
+#else
+/* One slot of the read pipeline of a dynamic transfer */
+struct aws_chunk {
+	struct iocb iocb;	/* first, so a completed iocb is its chunk */
+	char *buf;
+	size_t len;		/* bytes read into buf */
+	int ready;
+};
+#endif
+
+/* Value of a request header; len is sizeof(buf) when it did not fit. */
+struct aws_header_value {
+	char buf[AWS_HEADER_VALUE_MAX];
+	size_t len;
 };
 
 /* Structure acting as a connection handler */
 struct connection {
+	/* event loop owning the connection */
+	struct aws_loop *loop;
+	struct connection *closed_next;
+
+	/* header, idle or send timeout, whichever the state calls for */
+	struct timer timer;
+
     /* file to be sent */
 	int fd;
-	char filename[BUFSIZ];
+	struct file_cache_entry *cache_entry;
 
-    /* asynchronous notification */
-	int eventfd;
 	int sockfd;
 
-	io_context_t ctx;
-	struct iocb iocb;
-	struct iocb *piocb[1];
+#ifdef AWS_IO_URING
+	/* linked read -> send pair for the chunk in flight */
+	struct aws_uring_op read_op;
+	struct aws_uring_op send_op;
+	int buf_index;		/* registered buffer, -1 when from chunk_pool */
+	char *io_buf;
+	size_t chunk_len;	/* bytes of io_buf (or pipe) holding file data */
+	struct aws_pipe pipe;	/* with -z, instead of io_buf */
+	int read_pending;
+	int read_failed;
+	int send_cancelled;
+#else
+	/*
+	 * Ring of aws_pipeline_depth chunks: chunk_head is the next to be
+	 * sent, chunk_tail the next to be read into. Each iocb's data field
+	 * points back to the connection.
+	 */
+	struct aws_chunk *chunks;
+	unsigned int chunk_head;
+	unsigned int chunk_tail;
+	size_t read_pos;
+#endif
+	/* on the loop's buf_waiters; buf_wait_pprev is NULL when not */
+	struct connection *buf_wait_next;
+	struct connection **buf_wait_pprev;
+
+	/* requests not completed yet; conn is freed only once this is 0 */
+	int aio_inflight;
+
+	/*
+	 * request_path being opened by aws_open_pool, a precompressed sibling
+	 * when open_encoding is set; conn is not freed while open_pending.
+	 */
+	struct offload_job open_job;
+	struct file_cache_entry *opened;
+	int open_errno;		/* why opened is NULL */
+	unsigned int open_flags;
+	const char *open_encoding;
+	int open_pending;
+
 	size_t file_size;
 
-	/* buffers used for receiving messages */
-	char recv_buffer[BUFSIZ];
+	/* buffers used for receiving messages: recv_inline or a pool buffer */
+	char *recv_buffer;
+	size_t recv_size;
 	size_t recv_len;
 
-	/* Used for sending data (headers, 404 or data populated through async IO). */
-	char send_buffer[BUFSIZ];
+	/* reply body generated by the server, sent like a cached file */
+	char *body;
+
+	/* when the request was accepted or started to arrive, in microseconds */
+	uint64_t request_start;
+	int first_byte_sent;
+	uint64_t accept_time;		/* of the connection, in microseconds */
+	unsigned int nr_requests;	/* replies finished on the connection */
+	size_t reply_sent;	/* header and body bytes, for the access log */
+
+	/* client address, for the access log */
+	struct in_addr peer_addr;
+
+	/*
+	 * Reply header left to send, send_len bytes from header_iov[header_pos]
+	 * on. Its constant parts are sent from where they are kept; the Date
+	 * and the numbers of the reply are written to send_buffer.
+	 */
+	struct iovec header_iov[AWS_HEADER_IOVS];
+	int header_iovcnt;
+	int header_pos;
+	char send_buffer[AWS_HEADER_AREA];
+	size_t send_used;
 	size_t send_len;
 	size_t send_pos;
 	size_t file_pos;
 	size_t async_read_len;
 
-	/* HTTP request path */
-	int have_path;
-	char request_path[BUFSIZ];
+	/* bytes of the file to send: all of it, or the requested range */
+	size_t file_offset;
+	size_t file_end;
+	int status_code;	/* set unless a plain 200 or 404 */
+
+	/* validators of the file sent, those of its cache entry */
+	const struct file_validators *validators;
+
+	/*
+	 * HTTP request path, resolved against the document root, then
+	 * normalized and turned into the file path under its route's root
+	 */
+	size_t path_len;
+	char request_path[AWS_PATH_MAX];
+	const struct route *route;
 	enum resource_type res_type;
 	enum connection_state state;
 
-	/* HTTP_REQUEST parser */
+	/* reply with a persistent connection (HTTP/1.1 keep-alive) */
+	int keep_alive;
+
+	/* edge-triggered mode: socket not known to be drained yet */
+	int can_recv;
+	int can_send;
+
+	/* level-triggered mode: events the socket is registered for */
+	uint32_t poll_events;
+
+	/* HTTP_REQUEST parser, fed recv_buffer up to parsed_len so far */
 	http_parser request_parser;
+	size_t parsed_len;
+	int headers_done;
+	int request_done;
+
+	/* request header being parsed, and where its value is stored */
+	char header_name[AWS_HEADER_NAME_MAX];
+	size_t header_name_len;
+	int header_in_value;
+	struct aws_header_value *header_value;
+	struct aws_header_value range;
+	struct aws_header_value if_none_match;
+	struct aws_header_value if_modified_since;
+	struct aws_header_value accept_encoding;
+	struct aws_header_value transfer_encoding;
+
+	/* Content-Encoding and Vary lines of the reply, possibly empty */
+	const char *encoding_header;
+
+	char recv_inline[AWS_RECV_INLINE];
 };
 
+void aws_loop_init(struct aws_loop *loop, int id);
+void *aws_loop_run(void *arg);
+
 void handle_client(uint32_t event, struct connection *conn);
-void handle_new_connection(void);
+void handle_new_connection(struct aws_loop *loop);
 void handle_input(struct connection *conn);
 void handle_output(struct connection *conn);
 
-struct connection *connection_create(int sockfd);
+struct connection *connection_create(struct aws_loop *loop, int sockfd);
 void connection_remove(struct connection *conn);
 
 int connection_open_file(struct connection *conn);
 
-int connection_send_dynamic(struct connection *conn);
 void connection_start_async_io(struct connection *conn);
 enum connection_state connection_send_static(struct connection *conn);
-void connection_complete_async_io(struct connection *conn);
-void connection_start_async_io(struct connection *conn);
+#ifndef AWS_IO_URING
+int connection_send_dynamic(struct connection *conn);
+void connection_complete_async_io(struct connection *conn, struct iocb *iocb, long res);
+#endif
 
 int parse_header(struct connection *conn);
 
 void receive_data(struct connection *conn);
+void connection_process_request(struct connection *conn);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,621 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "file_cache.h"
+#include "utils/util.h"
+#include "utils/debug.h"
+
+/*
+ * Changes making entries stale: to a file itself, wherever it is reached
+ * from (dynamic files may be links to static ones), and to the names in
+ * the directories of cached files.
+ */
+#define FILE_CACHE_FILE_MASK	(IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#define FILE_CACHE_DIR_MASK	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+				 IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* FNV-1a */
+static size_t file_cache_hash(const char *path)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	while (*path) {
+		hash ^= (unsigned char)*path++;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static void lru_unlink(struct file_cache_entry *entry)
+{
+	entry->lru_prev->lru_next = entry->lru_next;
+	entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void lru_push_front(struct file_cache *fc, struct file_cache_entry *entry)
+{
+	entry->lru_prev = &fc->lru;
+	entry->lru_next = fc->lru.lru_next;
+	fc->lru.lru_next->lru_prev = entry;
+	fc->lru.lru_next = entry;
+}
+
+static size_t entry_bytes(struct file_cache_entry *entry)
+{
+	return sizeof(*entry) + (entry->content ? entry->size : 0);
+}
+
+static void entry_free(struct file_cache_entry *entry)
+{
+	close(entry->fd);
+	free(entry->content);
+	free(entry->path);
+	free(entry);
+}
+
+static struct file_cache_entry **wd_bucket(struct file_cache *fc, int wd)
+{
+	return &fc->wd_buckets[(unsigned int)wd & (fc->nr_buckets - 1)];
+}
+
+static struct file_cache_entry *file_cache_find_wd(struct file_cache *fc, int wd)
+{
+	struct file_cache_entry *entry;
+
+	for (entry = *wd_bucket(fc, wd); entry != NULL; entry = entry->wd_next)
+		if (entry->wd == wd)
+			return entry;
+
+	return NULL;
+}
+
+/* Remove a file watch no entry uses any longer. */
+static void file_cache_release_wd(struct file_cache *fc, int wd)
+{
+	if (file_cache_find_wd(fc, wd) == NULL)
+		inotify_rm_watch(fc->inotify_fd, wd);
+}
+
+/* Take entry out of the cache; it is freed once no connection uses it. */
+static void file_cache_unlink(struct file_cache *fc, struct file_cache_entry *entry)
+{
+	struct file_cache_entry **p;
+
+	p = &fc->buckets[file_cache_hash(entry->path) & (fc->nr_buckets - 1)];
+	while (*p != entry)
+		p = &(*p)->hash_next;
+	*p = entry->hash_next;
+
+	/* The watch goes with the last entry of the file. */
+	p = wd_bucket(fc, entry->wd);
+	while (*p != entry)
+		p = &(*p)->wd_next;
+	*p = entry->wd_next;
+	file_cache_release_wd(fc, entry->wd);
+
+	lru_unlink(entry);
+	fc->nr_entries--;
+	fc->bytes -= entry_bytes(entry);
+	entry->cached = 0;
+
+	if (entry->refcnt == 0)
+		entry_free(entry);
+}
+
+static void file_cache_shrink(struct file_cache *fc, size_t bytes)
+{
+	while (fc->nr_entries > 0 &&
+	       (fc->nr_entries >= fc->max_entries ||
+		fc->bytes + bytes > fc->max_bytes)) {
+		dlog(LOG_DEBUG, "Evicting %s\n", fc->lru.lru_prev->path);
+		file_cache_unlink(fc, fc->lru.lru_prev);
+	}
+}
+
+/*
+ * Media type of a file by its extension. A precompressed sibling has the
+ * type of the plain file, its encoding is told by Content-Encoding.
+ */
+static const char *file_content_type(const char *path)
+{
+	static const struct {
+		const char *ext;
+		const char *type;
+	} types[] = {
+		{ "html", "text/html; charset=utf-8" },
+		{ "htm", "text/html; charset=utf-8" },
+		{ "css", "text/css; charset=utf-8" },
+		{ "js", "text/javascript; charset=utf-8" },
+		{ "mjs", "text/javascript; charset=utf-8" },
+		{ "json", "application/json" },
+		{ "txt", "text/plain; charset=utf-8" },
+		{ "xml", "application/xml" },
+		{ "svg", "image/svg+xml" },
+		{ "png", "image/png" },
+		{ "jpg", "image/jpeg" },
+		{ "jpeg", "image/jpeg" },
+		{ "gif", "image/gif" },
+		{ "webp", "image/webp" },
+		{ "ico", "image/x-icon" },
+		{ "pdf", "application/pdf" },
+		{ "wasm", "application/wasm" },
+	};
+	size_t len = strlen(path);
+	size_t ext;
+	size_t i;
+
+	if (len > 3 && (strcmp(path + len - 3, ".br") == 0 ||
+			strcmp(path + len - 3, ".gz") == 0))
+		len -= 3;
+
+	for (ext = len; ext > 0 && path[ext - 1] != '.'; ext--)
+		if (path[ext - 1] == '/')
+			return "application/octet-stream";
+	if (ext == 0)
+		return "application/octet-stream";
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+		if (strlen(types[i].ext) == len - ext &&
+		    strncasecmp(path + ext, types[i].ext, len - ext) == 0)
+			return types[i].type;
+
+	return "application/octet-stream";
+}
+
+struct file_cache_entry *file_cache_load(const char *path, unsigned int flags)
+{
+	struct file_cache_entry *entry;
+	struct stat st;
+	size_t n;
+	int err;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	/* Directories and the like fail as EISDIR, never with a stale errno. */
+	err = fstat(fd, &st) < 0 ? errno : S_ISREG(st.st_mode) ? 0 : EISDIR;
+	if (err != 0) {
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	entry = calloc(1, sizeof(*entry));
+	DIE(entry == NULL, "calloc");
+
+	entry->path = strdup(path);
+	DIE(entry->path == NULL, "strdup");
+	entry->fd = fd;
+	entry->size = st.st_size;
+
+	/*
+	 * Small files are copied rather than mapped: a mapping of a file that
+	 * gets truncated under us would fault with SIGBUS.
+	 */
+	if ((flags & FILE_CACHE_CONTENT) && entry->size <= FILE_CACHE_CONTENT_MAX) {
+		entry->content = malloc(entry->size ? entry->size : 1);
+		DIE(entry->content == NULL, "malloc");
+		if (pread(fd, entry->content, entry->size, 0) != (ssize_t)entry->size) {
+			free(entry->content);
+			entry->content = NULL;
+		}
+	}
+
+	file_validators_init(&entry->validators, &st);
+	n = snprintf(entry->header, sizeof(entry->header), "Content-Type: %s\r\n",
+		     file_content_type(path));
+	entry->type_len = n;
+	n += snprintf(entry->header + n, sizeof(entry->header) - n,
+		      "Content-Length: %zu\r\n", entry->size);
+	entry->validators_off = n;
+	n += snprintf(entry->header + n, sizeof(entry->header) - n,
+		      "ETag: %s\r\n"
+		      "Last-Modified: %s\r\n", entry->validators.etag,
+		      entry->validators.last_modified);
+	entry->header_len = n;
+
+	if (flags & FILE_CACHE_ENCODINGS)
+		file_cache_encodings(entry);
+
+	return entry;
+}
+
+unsigned int file_cache_encodings(struct file_cache_entry *entry)
+{
+	static const struct {
+		const char *suffix;
+		unsigned int encoding;
+	} siblings[] = {
+		{ ".br", FILE_ENCODING_BR },
+		{ ".gz", FILE_ENCODING_GZIP },
+	};
+	char path[PATH_MAX];
+	struct stat st;
+	size_t i;
+
+	if (entry->encodings_probed)
+		return entry->encodings;
+
+	for (i = 0; i < sizeof(siblings) / sizeof(siblings[0]); i++) {
+		if ((size_t)snprintf(path, sizeof(path), "%s%s", entry->path,
+				     siblings[i].suffix) >= sizeof(path))
+			continue;
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+			entry->encodings |= siblings[i].encoding;
+	}
+	entry->encodings_probed = 1;
+
+	return entry->encodings;
+}
+
+void file_validators_init(struct file_validators *v, const struct stat *st)
+{
+	struct tm tm;
+
+	/* Any change of the file gives a new inode, size or mtime. */
+	v->mtime = st->st_mtim.tv_sec;
+	snprintf(v->etag, sizeof(v->etag), "\"%llx-%llx-%llx\"",
+		 (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+		 (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL +
+		 st->st_mtim.tv_nsec);
+
+	gmtime_r(&v->mtime, &tm);
+	strftime(v->last_modified, sizeof(v->last_modified),
+		 "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*
+ * Make sure the directory of path is watched. The file has been opened by
+ * then, maybe on a pool thread: file_cache_watch_file() checks the path
+ * still leads to it, unchanged, once watched, so that no change made in
+ * between goes unnoticed. Returns -1 if it cannot be watched.
+ */
+static int file_cache_watch_dir(struct file_cache *fc, const char *path)
+{
+	struct file_cache_dir *dir;
+	const char *slash;
+	size_t len;
+	int wd;
+
+	if (fc->inotify_fd < 0)
+		return -1;
+
+	slash = strrchr(path, '/');
+	len = slash != NULL ? (size_t)(slash - path) : 0;
+	for (dir = fc->dirs; dir != NULL; dir = dir->next)
+		if (dir->path_len == len && memcmp(dir->path, path, len) == 0)
+			return 0;
+
+	dir = malloc(sizeof(*dir));
+	DIE(dir == NULL, "malloc");
+	dir->path = len > 0 ? strndup(path, len) : strdup(".");
+	DIE(dir->path == NULL, "strdup");
+	dir->path_len = len;
+
+	wd = inotify_add_watch(fc->inotify_fd, dir->path, FILE_CACHE_DIR_MASK);
+	if (wd < 0) {
+		dlog(LOG_WARNING, "Cannot watch %s: %s\n", dir->path, strerror(errno));
+		free(dir->path);
+		free(dir);
+		return -1;
+	}
+
+	/* The same directory may be reached by two paths: both get a record. */
+	dir->wd = wd;
+	dir->next = fc->dirs;
+	fc->dirs = dir;
+
+	return 0;
+}
+
+/*
+ * Watch the file of a new entry, and the directory of its name. The path
+ * must still lead to the file opened, unchanged, once both are watched:
+ * what happens from then on is reported. Returns the file's watch, or -1
+ * if it cannot be watched.
+ */
+static int file_cache_watch_file(struct file_cache *fc, struct file_cache_entry *entry)
+{
+	struct file_validators v;
+	struct stat st;
+	int wd;
+
+	if (file_cache_watch_dir(fc, entry->path) < 0)
+		return -1;
+
+	wd = inotify_add_watch(fc->inotify_fd, entry->path, FILE_CACHE_FILE_MASK);
+	if (wd < 0)
+		return -1;
+
+	if (stat(entry->path, &st) < 0 || !S_ISREG(st.st_mode)) {
+		file_cache_release_wd(fc, wd);
+		return -1;
+	}
+
+	file_validators_init(&v, &st);
+	if (strcmp(v.etag, entry->validators.etag) != 0) {
+		file_cache_release_wd(fc, wd);
+		return -1;
+	}
+
+	return wd;
+}
+
+/* Stop watching a directory gone or moved; its files are flushed. */
+static void file_cache_unwatch(struct file_cache *fc, int wd)
+{
+	struct file_cache_dir **p = &fc->dirs;
+	struct file_cache_dir *dir;
+
+	while (*p != NULL) {
+		dir = *p;
+		if (dir->wd != wd) {
+			p = &dir->next;
+			continue;
+		}
+		*p = dir->next;
+		free(dir->path);
+		free(dir);
+	}
+	inotify_rm_watch(fc->inotify_fd, wd);
+}
+
+int file_cache_nr_watchable(int nr)
+{
+	int *fds;
+	int n;
+	int i;
+
+	fds = calloc(nr, sizeof(*fds));
+	DIE(fds == NULL, "calloc");
+
+	for (n = 0; n < nr; n++) {
+		fds[n] = inotify_init1(IN_CLOEXEC);
+		if (fds[n] < 0)
+			break;
+	}
+	for (i = 0; i < n; i++)
+		close(fds[i]);
+	free(fds);
+
+	return n;
+}
+
+void file_cache_init(struct file_cache *fc, size_t max_entries, size_t max_bytes)
+{
+	memset(fc, 0, sizeof(*fc));
+
+	fc->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fc->inotify_fd < 0)
+		dlog(LOG_WARNING, "inotify_init1: %s, files are not cached\n",
+		     strerror(errno));
+
+	fc->nr_buckets = 1;
+	while (fc->nr_buckets < 2 * max_entries)
+		fc->nr_buckets <<= 1;
+	fc->buckets = calloc(fc->nr_buckets, sizeof(*fc->buckets));
+	DIE(fc->buckets == NULL, "calloc");
+	fc->wd_buckets = calloc(fc->nr_buckets, sizeof(*fc->wd_buckets));
+	DIE(fc->wd_buckets == NULL, "calloc");
+
+	fc->lru.lru_next = &fc->lru;
+	fc->lru.lru_prev = &fc->lru;
+	fc->max_entries = max_entries;
+	fc->max_bytes = max_bytes;
+}
+
+static void file_cache_flush(struct file_cache *fc)
+{
+	while (fc->nr_entries > 0)
+		file_cache_unlink(fc, fc->lru.lru_prev);
+}
+
+void file_cache_destroy(struct file_cache *fc)
+{
+	file_cache_flush(fc);
+	while (fc->dirs != NULL)
+		file_cache_unwatch(fc, fc->dirs->wd);
+	if (fc->inotify_fd >= 0)
+		close(fc->inotify_fd);
+	free(fc->buckets);
+	free(fc->wd_buckets);
+	fc->buckets = NULL;
+	fc->wd_buckets = NULL;
+}
+
+static struct file_cache_entry *file_cache_find(struct file_cache *fc,
+						const char *path)
+{
+	struct file_cache_entry *entry;
+
+	entry = fc->buckets[file_cache_hash(path) & (fc->nr_buckets - 1)];
+	for (; entry != NULL; entry = entry->hash_next)
+		if (strcmp(entry->path, path) == 0)
+			return entry;
+
+	return NULL;
+}
+
+struct file_cache_entry *file_cache_lookup(struct file_cache *fc, const char *path)
+{
+	struct file_cache_entry *entry;
+
+	entry = file_cache_find(fc, path);
+	if (entry != NULL) {
+		lru_unlink(entry);
+		lru_push_front(fc, entry);
+		entry->refcnt++;
+	}
+
+	return entry;
+}
+
+struct file_cache_entry *file_cache_add(struct file_cache *fc,
+					struct file_cache_entry *entry)
+{
+	struct file_cache_entry **bucket;
+	struct file_cache_entry *cached;
+	int wd;
+
+	/* Loaded twice at once: the first one in is kept. */
+	cached = file_cache_lookup(fc, entry->path);
+	if (cached != NULL) {
+		entry_free(entry);
+		return cached;
+	}
+
+	/* Unwatched, the file is only opened for the caller. */
+	wd = file_cache_watch_file(fc, entry);
+	if (wd < 0) {
+		entry->wd = -1;
+		entry->refcnt = 1;
+		return entry;
+	}
+	entry->wd = wd;
+	entry->wd_next = *wd_bucket(fc, wd);
+	*wd_bucket(fc, wd) = entry;
+
+	file_cache_shrink(fc, entry_bytes(entry));
+
+	bucket = &fc->buckets[file_cache_hash(entry->path) & (fc->nr_buckets - 1)];
+	entry->hash_next = *bucket;
+	*bucket = entry;
+	lru_push_front(fc, entry);
+	fc->nr_entries++;
+	fc->bytes += entry_bytes(entry);
+	entry->cached = 1;
+	entry->refcnt = 1;
+
+	return entry;
+}
+
+struct file_cache_entry *file_cache_get(struct file_cache *fc, const char *path,
+					unsigned int flags)
+{
+	struct file_cache_entry *entry;
+
+	entry = file_cache_lookup(fc, path);
+	if (entry != NULL)
+		return entry;
+
+	entry = file_cache_load(path, flags);
+	if (entry == NULL)
+		return NULL;
+
+	return file_cache_add(fc, entry);
+}
+
+void file_cache_put(struct file_cache *fc, struct file_cache_entry *entry)
+{
+	entry->refcnt--;
+	if (entry->refcnt == 0 && !entry->cached)
+		entry_free(entry);
+}
+
+/* Drop the entry of dir/name, and that of the file it may be a sibling of. */
+static void file_cache_invalidate(struct file_cache *fc, struct file_cache_dir *dir,
+				  const char *name)
+{
+	static const char *const suffixes[] = { ".br", ".gz" };
+	struct file_cache_entry *entry;
+	char path[PATH_MAX];
+	size_t i;
+	int n;
+
+	n = snprintf(path, sizeof(path), "%s/%s", dir->path, name);
+	if (n < 0 || (size_t)n >= sizeof(path))
+		return;
+
+	entry = file_cache_find(fc, path);
+	if (entry != NULL) {
+		dlog(LOG_DEBUG, "Invalidating %s\n", path);
+		file_cache_unlink(fc, entry);
+	}
+
+	/* The encodings found for the plain file no longer hold. */
+	for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+		if (n <= 3 || strcmp(path + n - 3, suffixes[i]) != 0)
+			continue;
+		path[n - 3] = '\0';
+		entry = file_cache_find(fc, path);
+		if (entry != NULL)
+			file_cache_unlink(fc, entry);
+		break;
+	}
+}
+
+static void file_cache_handle_event(struct file_cache *fc,
+				    const struct inotify_event *ev)
+{
+	struct file_cache_entry *entry;
+	struct file_cache_dir *dir;
+
+	/* Changes were lost: nothing cached can be trusted. */
+	if (ev->mask & IN_Q_OVERFLOW) {
+		file_cache_flush(fc);
+		return;
+	}
+
+	/* Paths through a directory gone or moved no longer lead anywhere. */
+	if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+		for (dir = fc->dirs; dir != NULL; dir = dir->next)
+			if (dir->wd == ev->wd)
+				break;
+		if (dir != NULL) {
+			file_cache_flush(fc);
+			file_cache_unwatch(fc, ev->wd);
+			return;
+		}
+	}
+
+	/* A name in a directory, or a file itself, under any of its names. */
+	if (ev->len > 0) {
+		for (dir = fc->dirs; dir != NULL; dir = dir->next)
+			if (dir->wd == ev->wd)
+				file_cache_invalidate(fc, dir, ev->name);
+		return;
+	}
+
+	while ((entry = file_cache_find_wd(fc, ev->wd)) != NULL) {
+		dlog(LOG_DEBUG, "Invalidating %s\n", entry->path);
+		file_cache_unlink(fc, entry);
+	}
+}
+
+void file_cache_handle_events(struct file_cache *fc)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+
+	for (;;) {
+		len = read(fc->inotify_fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			DIE(errno != EAGAIN, "read inotify");
+			return;
+		}
+
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			file_cache_handle_event(fc, ev);
+		}
+	}
+}
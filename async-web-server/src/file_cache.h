@@ -0,0 +1,161 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef FILE_CACHE_H_
+#define FILE_CACHE_H_	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* limits of the per-loop cache of static files */
+#define FILE_CACHE_MAX_ENTRIES		1024
+#define FILE_CACHE_MAX_BYTES		(32 * 1024 * 1024)
+
+/* files up to this size are also kept in memory, if asked for */
+#define FILE_CACHE_CONTENT_MAX		(64 * 1024)
+
+/* flags of file_cache_get() and file_cache_load() */
+#define FILE_CACHE_CONTENT		(1U << 0)
+#define FILE_CACHE_ENCODINGS		(1U << 1)	/* probe siblings at once */
+
+#define FILE_CACHE_HEADER_SIZE		256
+
+#define FILE_ETAG_SIZE			48
+#define FILE_DATE_SIZE			32
+
+/* precompressed siblings of a file, kept next to it as path.br / path.gz */
+#define FILE_ENCODING_BR		(1U << 0)
+#define FILE_ENCODING_GZIP		(1U << 1)
+
+struct stat;
+
+/* Validators of the version of a file, ready to be sent as header values */
+struct file_validators {
+	time_t mtime;
+	char etag[FILE_ETAG_SIZE];		/* quoted, strong */
+	char last_modified[FILE_DATE_SIZE];	/* IMF-fixdate */
+};
+
+/*
+ * An open file kept by the cache. The entry stays valid while it is
+ * referenced, even after being evicted from the cache.
+ */
+struct file_cache_entry {
+	char *path;
+	int fd;
+	size_t size;
+
+	/* file contents for small files, NULL otherwise */
+	char *content;
+
+	struct file_validators validators;
+
+	/*
+	 * Pre-rendered entity headers, each line ending in "\r\n": the first
+	 * type_len bytes are Content-Type, followed by Content-Length, then
+	 * the validators from validators_off on.
+	 */
+	char header[FILE_CACHE_HEADER_SIZE];
+	size_t header_len;
+	size_t type_len;
+	size_t validators_off;
+
+	/* FILE_ENCODING_* siblings found, once encodings_probed is set */
+	unsigned int encodings;
+	int encodings_probed;
+
+	unsigned int refcnt;
+	int cached;
+
+	/* inotify watch of the file, shared by the entries of its aliases */
+	int wd;
+	struct file_cache_entry *wd_next;
+
+	struct file_cache_entry *hash_next;
+	struct file_cache_entry *lru_prev;
+	struct file_cache_entry *lru_next;
+};
+
+/* A directory of cached files, watched for files renamed or removed */
+struct file_cache_dir {
+	int wd;
+	char *path;		/* as found in entry paths, without the last '/' */
+	size_t path_len;
+	struct file_cache_dir *next;
+};
+
+/*
+ * Open files looked up by path. Entries are dropped as soon as inotify
+ * reports a change to their file, to its name, or to a precompressed
+ * sibling of it; a file that cannot be watched is not kept.
+ */
+struct file_cache {
+	int inotify_fd;		/* -1 when inotify is not available */
+	struct file_cache_dir *dirs;
+	struct file_cache_entry **wd_buckets;	/* entries by watch */
+
+	struct file_cache_entry **buckets;
+	size_t nr_buckets;
+
+	/* LRU list sentinel: lru.lru_next is the most recently used entry */
+	struct file_cache_entry lru;
+
+	size_t nr_entries;
+	size_t bytes;
+	size_t max_entries;
+	size_t max_bytes;
+};
+
+void file_cache_init(struct file_cache *fc, size_t max_entries, size_t max_bytes);
+
+/*
+ * How many of nr caches about to be set up would get an inotify instance,
+ * which each needs to cache anything; 0 when inotify is not there at all.
+ */
+int file_cache_nr_watchable(int nr);
+void file_cache_destroy(struct file_cache *fc);
+
+/*
+ * Return a referenced entry for path, opening the file on a miss, and with
+ * FILE_CACHE_CONTENT reading small files into memory as well. Returns NULL,
+ * with errno set, if path is not a readable regular file.
+ */
+struct file_cache_entry *file_cache_get(struct file_cache *fc, const char *path,
+					unsigned int flags);
+
+/*
+ * file_cache_get() in two steps, for misses to be served off the loop:
+ * file_cache_lookup() returns a referenced entry on a hit only.
+ * file_cache_load() opens path as a new entry, without touching any cache,
+ * and may be called from any thread; it returns NULL as file_cache_get()
+ * does. file_cache_add() then caches that entry and returns it referenced,
+ * or the one cached for path in the meantime, freeing it.
+ */
+struct file_cache_entry *file_cache_lookup(struct file_cache *fc, const char *path);
+struct file_cache_entry *file_cache_load(const char *path, unsigned int flags);
+struct file_cache_entry *file_cache_add(struct file_cache *fc,
+					struct file_cache_entry *entry);
+
+/* Drop a reference obtained through file_cache_get(). */
+void file_cache_put(struct file_cache *fc, struct file_cache_entry *entry);
+
+/* Drop the entries of the files changed, once inotify_fd is readable. */
+void file_cache_handle_events(struct file_cache *fc);
+
+/*
+ * Return the FILE_ENCODING_* siblings of entry. They are looked for on the
+ * first call only.
+ */
+unsigned int file_cache_encodings(struct file_cache_entry *entry);
+
+/* Fill in the validators of the file described by st. */
+void file_validators_init(struct file_validators *v, const struct stat *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#include "mem_pool.h"
+#include "utils/util.h"
+
+#define MEM_POOL_PAGE_SIZE	4096
+
+/* Slab header; objects follow it, suitably aligned. */
+struct slab {
+	struct slab *next;
+} __attribute__((aligned(_Alignof(max_align_t))));
+
+/* Free objects and buffers are chained through their first bytes. */
+struct free_node {
+	struct free_node *next;
+};
+
+static size_t align_up(size_t size, size_t align)
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+void slab_cache_init(struct slab_cache *sc, size_t obj_size, unsigned int objs_per_slab)
+{
+	if (obj_size < sizeof(struct free_node))
+		obj_size = sizeof(struct free_node);
+
+	sc->obj_size = align_up(obj_size, _Alignof(max_align_t));
+	sc->objs_per_slab = objs_per_slab;
+	sc->free_list = NULL;
+	sc->slabs = NULL;
+	sc->nr_objs = 0;
+}
+
+void slab_cache_destroy(struct slab_cache *sc)
+{
+	struct slab *slab, *next;
+
+	for (slab = sc->slabs; slab != NULL; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+	sc->slabs = NULL;
+	sc->free_list = NULL;
+}
+
+static void slab_cache_grow(struct slab_cache *sc)
+{
+	struct slab *slab;
+	struct free_node *node;
+	char *objs;
+	unsigned int i;
+
+	slab = malloc(sizeof(*slab) + (size_t)sc->objs_per_slab * sc->obj_size);
+	DIE(slab == NULL, "malloc");
+	slab->next = sc->slabs;
+	sc->slabs = slab;
+
+	/* Push in reverse so objects are handed out in address order. */
+	objs = (char *)(slab + 1);
+	for (i = sc->objs_per_slab; i > 0; i--) {
+		node = (struct free_node *)(objs + (size_t)(i - 1) * sc->obj_size);
+		node->next = sc->free_list;
+		sc->free_list = node;
+	}
+}
+
+void *slab_cache_alloc(struct slab_cache *sc)
+{
+	struct free_node *node;
+
+	if (sc->free_list == NULL)
+		slab_cache_grow(sc);
+
+	node = sc->free_list;
+	sc->free_list = node->next;
+	sc->nr_objs++;
+
+	return node;
+}
+
+void slab_cache_free(struct slab_cache *sc, void *obj)
+{
+	struct free_node *node = obj;
+
+	node->next = sc->free_list;
+	sc->free_list = node;
+	sc->nr_objs--;
+}
+
+void buf_budget_init(struct buf_budget *bb, size_t limit)
+{
+	bb->limit = limit;
+	bb->used = 0;
+}
+
+/* Reserve size bytes of the budget, or nothing if that would go over it. */
+static int buf_budget_take(struct buf_budget *bb, size_t size)
+{
+	if (__atomic_add_fetch(&bb->used, size, __ATOMIC_RELAXED) > bb->limit) {
+		__atomic_sub_fetch(&bb->used, size, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void buf_budget_give(struct buf_budget *bb, size_t size)
+{
+	__atomic_sub_fetch(&bb->used, size, __ATOMIC_RELAXED);
+}
+
+void buf_pool_init(struct buf_pool *bp, size_t buf_size, size_t max_free,
+		   struct buf_budget *budget)
+{
+	bp->buf_size = align_up(buf_size, MEM_POOL_PAGE_SIZE);
+	bp->budget = budget;
+	bp->free_list = NULL;
+	bp->nr_free = 0;
+	bp->max_free = max_free;
+}
+
+void buf_pool_destroy(struct buf_pool *bp)
+{
+	struct free_node *node;
+
+	while (bp->free_list != NULL) {
+		node = bp->free_list;
+		bp->free_list = node->next;
+		free(node);
+	}
+	bp->nr_free = 0;
+}
+
+void *buf_pool_get(struct buf_pool *bp)
+{
+	struct free_node *node;
+
+	if (bp->budget != NULL && !buf_budget_take(bp->budget, bp->buf_size))
+		return NULL;
+
+	if (bp->free_list == NULL) {
+		node = aligned_alloc(MEM_POOL_PAGE_SIZE, bp->buf_size);
+		DIE(node == NULL, "aligned_alloc");
+		return node;
+	}
+
+	node = bp->free_list;
+	bp->free_list = node->next;
+	bp->nr_free--;
+
+	return node;
+}
+
+void buf_pool_put(struct buf_pool *bp, void *buf)
+{
+	struct free_node *node = buf;
+
+	if (bp->budget != NULL)
+		buf_budget_give(bp->budget, bp->buf_size);
+
+	if (bp->nr_free >= bp->max_free) {
+		free(buf);
+		return;
+	}
+
+	node->next = bp->free_list;
+	bp->free_list = node;
+	bp->nr_free++;
+}
+
+int buf_pool_available(const struct buf_pool *bp)
+{
+	if (bp->budget == NULL)
+		return 1;
+
+	return __atomic_load_n(&bp->budget->used, __ATOMIC_RELAXED) + bp->buf_size <=
+	       bp->budget->limit;
+}
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef MEM_POOL_H_
+#define MEM_POOL_H_	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/*
+ * Fixed-size objects carved out of larger slabs and recycled through a free
+ * list. Slabs are only given back to the system by slab_cache_destroy().
+ */
+struct slab_cache {
+	size_t obj_size;
+	unsigned int objs_per_slab;
+
+	void *free_list;
+	void *slabs;		/* chain of all slabs */
+
+	size_t nr_objs;		/* objects handed out */
+};
+
+void slab_cache_init(struct slab_cache *sc, size_t obj_size, unsigned int objs_per_slab);
+void slab_cache_destroy(struct slab_cache *sc);
+void *slab_cache_alloc(struct slab_cache *sc);
+void slab_cache_free(struct slab_cache *sc, void *obj);
+
+/*
+ * Bytes that may be lent out by all the pools sharing the budget, whichever
+ * thread they belong to. Buffers cached on a pool's free list do not count.
+ */
+struct buf_budget {
+	size_t limit;
+	size_t used;		/* updated atomically */
+};
+
+void buf_budget_init(struct buf_budget *bb, size_t limit);
+
+/*
+ * Page-aligned buffers of a single size, lent out while needed. Up to
+ * max_free returned buffers are kept for reuse, the rest are freed. With a
+ * budget, buf_pool_get() returns NULL rather than go over it.
+ */
+struct buf_pool {
+	size_t buf_size;
+	struct buf_budget *budget;	/* NULL for no limit */
+
+	void *free_list;
+	size_t nr_free;
+	size_t max_free;
+};
+
+void buf_pool_init(struct buf_pool *bp, size_t buf_size, size_t max_free,
+		   struct buf_budget *budget);
+void buf_pool_destroy(struct buf_pool *bp);
+void *buf_pool_get(struct buf_pool *bp);
+void buf_pool_put(struct buf_pool *bp, void *buf);
+
+/* Whether buf_pool_get() would succeed now; it may no longer right after. */
+int buf_pool_available(const struct buf_pool *bp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "utils/util.h"
+
+#define METRICS_MAX_SOURCES	256
+
+static struct metrics *sources[METRICS_MAX_SOURCES];
+static int nr_sources;
+
+/* Output buffer of metrics_render(); text past size is dropped. */
+struct text {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+uint64_t metrics_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int histogram_index(uint64_t usec)
+{
+	int exp;
+
+	if (usec < METRICS_SUB_BUCKETS)
+		return usec;
+
+	exp = 63 - __builtin_clzll(usec);
+	if (exp > METRICS_MAX_EXP)
+		return METRICS_NR_BUCKETS - 1;
+
+	/* usec is 1xx... in binary: the bits after the leading one pick the bucket */
+	return METRICS_SUB_BUCKETS * (exp - METRICS_SUB_BITS + 1) +
+	       (usec >> (exp - METRICS_SUB_BITS)) - METRICS_SUB_BUCKETS;
+}
+
+/* Largest value counted in bucket i. */
+static uint64_t histogram_upper(int i)
+{
+	int exp;
+
+	if (i < METRICS_SUB_BUCKETS)
+		return i;
+
+	exp = i / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+
+	return ((uint64_t)(METRICS_SUB_BUCKETS + i % METRICS_SUB_BUCKETS + 1)
+		<< (exp - METRICS_SUB_BITS)) - 1;
+}
+
+void metrics_observe(struct metrics_histogram *h, uint64_t usec)
+{
+	metrics_add(&h->buckets[histogram_index(usec)], 1);
+	metrics_add(&h->count, 1);
+	metrics_add(&h->sum, usec);
+}
+
+void metrics_register(struct metrics *m)
+{
+	DIE(nr_sources == METRICS_MAX_SOURCES, "metrics_register");
+	sources[nr_sources++] = m;
+}
+
+static int64_t metrics_read(const int64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void text_printf(struct text *t, const char *format, ...)
+{
+	va_list ap;
+	int n;
+
+	if (t->len >= t->size)
+		return;
+
+	va_start(ap, format);
+	n = vsnprintf(t->buf + t->len, t->size - t->len, format, ap);
+	va_end(ap);
+
+	if (n > 0)
+		t->len = t->len + n < t->size ? t->len + n : t->size;
+}
+
+/* Sum a counter over all loops, given its offset in struct metrics. */
+static int64_t metrics_sum(size_t offset)
+{
+	int64_t sum = 0;
+	int i;
+
+	for (i = 0; i < nr_sources; i++)
+		sum += metrics_read((const int64_t *)((const char *)sources[i] + offset));
+
+	return sum;
+}
+
+static void render_counter(struct text *t, const char *name, const char *type,
+			   const char *help, size_t offset)
+{
+	text_printf(t, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", name, help,
+		    name, type, name, (long long)metrics_sum(offset));
+}
+
+static void render_histogram(struct text *t, const char *name, const char *help,
+			     size_t offset)
+{
+	struct metrics_histogram h;
+	const struct metrics_histogram *src;
+	int64_t cumulative = 0;
+	int i, j;
+
+	memset(&h, 0, sizeof(h));
+	for (i = 0; i < nr_sources; i++) {
+		src = (const struct metrics_histogram *)((const char *)sources[i] + offset);
+		for (j = 0; j < METRICS_NR_BUCKETS; j++)
+			h.buckets[j] += metrics_read(&src->buckets[j]);
+		h.count += metrics_read(&src->count);
+		h.sum += metrics_read(&src->sum);
+	}
+
+	/*
+	 * Every bucket is written, empty or not: histogram_quantile() needs
+	 * the same le bounds on every scrape. The last one is +Inf.
+	 */
+	text_printf(t, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for (j = 0; j < METRICS_NR_BUCKETS - 1; j++) {
+		cumulative += h.buckets[j];
+		text_printf(t, "%s_bucket{le=\"%g\"} %lld\n", name,
+			    histogram_upper(j) / 1e6, (long long)cumulative);
+	}
+	text_printf(t, "%s_bucket{le=\"+Inf\"} %lld\n", name, (long long)h.count);
+	text_printf(t, "%s_sum %.6f\n%s_count %lld\n", name, h.sum / 1e6,
+		    name, (long long)h.count);
+}
+
+size_t metrics_render(char *buf, size_t size, const char *const state_names[],
+		      int nr_states)
+{
+	struct text t = { .buf = buf, .size = size, .len = 0 };
+	int i;
+
+	render_counter(&t, "aws_connections_accepted_total", "counter",
+		       "Connections accepted.", offsetof(struct metrics, accepted));
+	render_counter(&t, "aws_requests_total", "counter",
+		       "Replies fully sent or aborted.",
+		       offsetof(struct metrics, requests));
+	render_counter(&t, "aws_connection_timeouts_total", "counter",
+		       "Connections dropped for a request, idle or send timeout.",
+		       offsetof(struct metrics, timeouts));
+	render_counter(&t, "aws_connections_shed_total", "counter",
+		       "Connections closed right after accept for lack of file descriptors.",
+		       offsetof(struct metrics, shed));
+	render_counter(&t, "aws_accept_paused", "gauge",
+		       "Loops not accepting connections, over their budget or out of fds.",
+		       offsetof(struct metrics, accept_paused));
+	render_counter(&t, "aws_sent_bytes_total", "counter",
+		       "Bytes written to client sockets.",
+		       offsetof(struct metrics, bytes_sent));
+	render_counter(&t, "aws_async_io_inflight", "gauge",
+		       "Asynchronous file reads and sends not completed yet.",
+		       offsetof(struct metrics, async_inflight));
+	render_counter(&t, "aws_buffer_waits", "gauge",
+		       "Dynamic transfers waiting for the chunk buffer budget.",
+		       offsetof(struct metrics, buffer_waits));
+
+	text_printf(&t, "# HELP aws_connections Open connections by state.\n"
+		    "# TYPE aws_connections gauge\n");
+	for (i = 0; i < nr_states && i < METRICS_MAX_STATES; i++)
+		text_printf(&t, "aws_connections{state=\"%s\"} %lld\n", state_names[i],
+			    (long long)metrics_sum(offsetof(struct metrics, states) +
+						   i * sizeof(int64_t)));
+
+	render_histogram(&t, "aws_time_to_first_byte_seconds",
+			 "Time from accepting or reading a request to sending the first byte of its reply.",
+			 offsetof(struct metrics, first_byte));
+	render_histogram(&t, "aws_time_to_last_byte_seconds",
+			 "Time from accepting or reading a request to sending the last byte of its reply.",
+			 offsetof(struct metrics, last_byte));
+	render_histogram(&t, "aws_connection_time_to_first_byte_seconds",
+			 "Time from accepting a connection to sending the first byte on it.",
+			 offsetof(struct metrics, conn_first_byte));
+	render_histogram(&t, "aws_connection_duration_seconds",
+			 "Time from accepting a connection to closing it.",
+			 offsetof(struct metrics, conn_duration));
+
+	return t.len;
+}
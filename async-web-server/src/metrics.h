@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef METRICS_H_
+#define METRICS_H_	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Log-linear (HDR-style) histogram of microsecond values: exact below
+ * METRICS_SUB_BUCKETS, then METRICS_SUB_BUCKETS buckets per power of two,
+ * so a bucket is never wider than a quarter of its values. Values from
+ * 2^(METRICS_MAX_EXP + 1) us (about 19 hours) on share the last bucket.
+ */
+#define METRICS_SUB_BITS	2
+#define METRICS_SUB_BUCKETS	(1 << METRICS_SUB_BITS)
+#define METRICS_MAX_EXP		35
+#define METRICS_NR_BUCKETS	\
+	(METRICS_SUB_BUCKETS * (METRICS_MAX_EXP - METRICS_SUB_BITS + 2))
+
+#define METRICS_MAX_STATES	16
+
+/* room needed by metrics_render() */
+#define METRICS_TEXT_MAX	(64 * 1024)
+
+struct metrics_histogram {
+	int64_t buckets[METRICS_NR_BUCKETS];
+	int64_t count;
+	int64_t sum;		/* microseconds */
+};
+
+/*
+ * Counters of one event loop. Only the loop's thread updates them, so no
+ * locked instructions are needed; other threads only read them.
+ */
+struct metrics {
+	int64_t accepted;
+	int64_t requests;
+	int64_t timeouts;		/* connections dropped by a timer */
+	int64_t shed;			/* connections closed unserved, out of fds */
+	int64_t accept_paused;		/* loops not accepting */
+	int64_t bytes_sent;
+	int64_t async_inflight;		/* file reads and sends queued */
+	int64_t buffer_waits;		/* transfers waiting for chunk buffers */
+	int64_t states[METRICS_MAX_STATES];	/* connections per state */
+
+	struct metrics_histogram first_byte;	/* request to first byte sent */
+	struct metrics_histogram last_byte;	/* request to last byte sent */
+
+	/* observed once per connection */
+	struct metrics_histogram conn_first_byte;	/* accept to first byte sent */
+	struct metrics_histogram conn_duration;		/* accept to close */
+};
+
+/* Update a counter owned by the calling thread. */
+static inline void metrics_add(int64_t *counter, int64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_now_usec(void);
+void metrics_observe(struct metrics_histogram *h, uint64_t usec);
+
+/* Make m part of what is rendered; called before the loops start. */
+void metrics_register(struct metrics *m);
+
+/*
+ * Render the sum of all registered metrics in the Prometheus text format.
+ * state_names labels the first nr_states entries of metrics.states.
+ * Returns the length of the text.
+ */
+size_t metrics_render(char *buf, size_t size, const char *const state_names[],
+		      int nr_states);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
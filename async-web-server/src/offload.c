@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+#include "offload.h"
+#include "utils/util.h"
+
+static void offload_queue_post(struct offload_queue *q, struct offload_job *job)
+{
+	static const uint64_t one = 1;
+	int was_empty;
+
+	job->next = NULL;
+	pthread_mutex_lock(&q->lock);
+	was_empty = q->head == NULL;
+	*q->tail = job;
+	q->tail = &job->next;
+	pthread_mutex_unlock(&q->lock);
+
+	/* The loop takes everything queued: one wakeup per batch is enough. */
+	if (was_empty)
+		DIE(write(q->eventfd, &one, sizeof(one)) < 0, "write eventfd");
+}
+
+static void *offload_thread(void *arg)
+{
+	struct offload_pool *pool = arg;
+	struct offload_job *job;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->head == NULL)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		job = pool->head;
+		pool->head = job->next;
+		if (pool->head == NULL)
+			pool->tail = &pool->head;
+		pthread_mutex_unlock(&pool->lock);
+
+		job->fn(job);
+		offload_queue_post(job->done, job);
+	}
+
+	return NULL;
+}
+
+void offload_pool_init(struct offload_pool *pool, unsigned int nr_threads)
+{
+	pthread_t thread;
+	unsigned int i;
+	int rc;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->head = NULL;
+	pool->tail = &pool->head;
+
+	for (i = 0; i < nr_threads; i++) {
+		rc = pthread_create(&thread, NULL, offload_thread, pool);
+		DIE(rc != 0, "pthread_create");
+		pthread_detach(thread);
+	}
+}
+
+void offload_submit(struct offload_pool *pool, struct offload_job *job,
+		    struct offload_queue *done)
+{
+	job->done = done;
+	job->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	*pool->tail = job;
+	pool->tail = &job->next;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void offload_queue_init(struct offload_queue *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	q->head = NULL;
+	q->tail = &q->head;
+	q->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	DIE(q->eventfd < 0, "eventfd");
+}
+
+struct offload_job *offload_queue_take(struct offload_queue *q)
+{
+	struct offload_job *jobs;
+	uint64_t count;
+
+	/* Reset the counter first: jobs posted from now on wake us up again. */
+	if (read(q->eventfd, &count, sizeof(count)) < 0)
+		DIE(errno != EAGAIN, "read eventfd");
+
+	pthread_mutex_lock(&q->lock);
+	jobs = q->head;
+	q->head = NULL;
+	q->tail = &q->head;
+	pthread_mutex_unlock(&q->lock);
+
+	return jobs;
+}
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef OFFLOAD_H_
+#define OFFLOAD_H_	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+
+/*
+ * Blocking work run off the event loops by a pool of threads. A job is
+ * handed back, once run, to the queue it was submitted with; the queue's
+ * eventfd wakes up the loop owning it, which takes the jobs done at once.
+ */
+struct offload_queue;
+
+struct offload_job {
+	void (*fn)(struct offload_job *job);	/* run by a pool thread */
+	struct offload_queue *done;
+	struct offload_job *next;
+};
+
+/* Jobs done, on their way back to a loop */
+struct offload_queue {
+	pthread_mutex_t lock;
+	struct offload_job *head;
+	struct offload_job **tail;
+	int eventfd;		/* readable once jobs are queued */
+};
+
+/* Jobs waiting for a thread, run in the order submitted */
+struct offload_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct offload_job *head;
+	struct offload_job **tail;
+};
+
+/* Start nr_threads threads, which run for as long as the process. */
+void offload_pool_init(struct offload_pool *pool, unsigned int nr_threads);
+
+/* Have job->fn run by a thread of pool, then job queued on done. */
+void offload_submit(struct offload_pool *pool, struct offload_job *job,
+		    struct offload_queue *done);
+
+void offload_queue_init(struct offload_queue *q);
+
+/* Take the jobs done so far, oldest first, in a list linked by next. */
+struct offload_job *offload_queue_take(struct offload_queue *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
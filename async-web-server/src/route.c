@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "route.h"
+#include "utils/util.h"
+
+#define FNV_OFFSET	14695981039346656037ULL
+#define FNV_PRIME	1099511628211ULL
+
+/* FNV-1a, one byte at a time so that every prefix of a path gets hashed. */
+static inline uint64_t route_hash_byte(uint64_t hash, char c)
+{
+	return (hash ^ (unsigned char)c) * FNV_PRIME;
+}
+
+static uint64_t route_hash(const char *s, size_t len)
+{
+	uint64_t hash = FNV_OFFSET;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = route_hash_byte(hash, s[i]);
+
+	return hash;
+}
+
+void route_table_init(struct route_table *rt, const struct route *routes,
+		      size_t nr_routes)
+{
+	struct route_slot *slot;
+	size_t len, i, j;
+	uint64_t hash;
+
+	rt->nr_slots = 1;
+	while (rt->nr_slots < 2 * nr_routes)
+		rt->nr_slots <<= 1;
+	rt->slots = calloc(rt->nr_slots, sizeof(*rt->slots));
+	DIE(rt->slots == NULL, "calloc");
+
+	/* Open addressing, probing linearly from the slot of the hash. */
+	for (i = 0; i < nr_routes; i++) {
+		len = strlen(routes[i].prefix);
+		hash = route_hash(routes[i].prefix, len);
+		for (j = hash & (rt->nr_slots - 1); rt->slots[j].route != NULL;
+		     j = (j + 1) & (rt->nr_slots - 1)) {
+			slot = &rt->slots[j];
+			DIE(slot->len == len && memcmp(slot->route->prefix,
+						       routes[i].prefix, len) == 0,
+			    "duplicate route");
+		}
+
+		rt->slots[j].hash = hash;
+		rt->slots[j].len = len;
+		rt->slots[j].route = &routes[i];
+	}
+}
+
+static const struct route *route_find(const struct route_table *rt, uint64_t hash,
+				      const char *prefix, size_t len)
+{
+	const struct route_slot *slot;
+	size_t j;
+
+	for (j = hash & (rt->nr_slots - 1); rt->slots[j].route != NULL;
+	     j = (j + 1) & (rt->nr_slots - 1)) {
+		slot = &rt->slots[j];
+		if (slot->hash == hash && slot->len == len &&
+		    memcmp(slot->route->prefix, prefix, len) == 0)
+			return slot->route;
+	}
+
+	return NULL;
+}
+
+const struct route *route_lookup(const struct route_table *rt, const char *path,
+				 size_t len, size_t *prefix_len)
+{
+	const struct route *route = NULL;
+	const struct route *found;
+	uint64_t hash = FNV_OFFSET;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash = route_hash_byte(hash, path[i]);
+		if (path[i] != '/' && i + 1 < len)
+			continue;
+
+		found = route_find(rt, hash, path, i + 1);
+		if (found != NULL) {
+			route = found;
+			*prefix_len = i + 1;
+		}
+	}
+
+	return route;
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+int route_normalize_path(char *path, size_t *len)
+{
+	size_t in = 0;
+	size_t out = 0;
+	size_t seg = 0;		/* start of the segment being written */
+	int hi, lo;
+	int end;
+	char c;
+
+	/* Decoding only shrinks the path: out never passes in. */
+	for (;;) {
+		end = in == *len;
+		if (!end) {
+			c = path[in++];
+			if (c == '%') {
+				if (*len - in < 2)
+					return -1;
+				hi = hex_value(path[in]);
+				lo = hex_value(path[in + 1]);
+				if (hi < 0 || lo < 0 || (hi == 0 && lo == 0))
+					return -1;
+				c = (char)(hi << 4 | lo);
+				in += 2;
+			}
+			if (c != '/') {
+				path[out++] = c;
+				continue;
+			}
+		}
+
+		/* A segment ends at path[out]: keep it, drop it or go up. */
+		if (out - seg == 1 && path[seg] == '.') {
+			out = seg;
+		} else if (out - seg == 2 && path[seg] == '.' && path[seg + 1] == '.') {
+			if (seg == 0)
+				return -1;
+			out = seg - 1;
+			while (out > 0 && path[out - 1] != '/')
+				out--;
+		} else if (out > seg && !end) {
+			path[out++] = '/';
+		}
+
+		if (end)
+			break;
+		seg = out;
+	}
+
+	path[out] = '\0';
+	*len = out;
+
+	return 0;
+}
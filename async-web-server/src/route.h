@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef ROUTE_H_
+#define ROUTE_H_	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/*
+ * A mount point. Paths starting with prefix, a directory ending in '/',
+ * or equal to it, for a prefix naming a single resource, are served by
+ * handler from the files under root, cached as cache_flags tell.
+ */
+struct route {
+	const char *prefix;	/* without the leading '/' */
+	const char *root;	/* takes the place of prefix in the file path */
+	int handler;
+	unsigned int cache_flags;
+};
+
+struct route_slot {
+	size_t hash;
+	size_t len;
+	const struct route *route;	/* NULL for a free slot */
+};
+
+/*
+ * Routes hashed by prefix. A lookup hashes the path once, probing the
+ * table at each '/' and at the end, so it takes time linear in the length
+ * of the path whatever the number of routes; the longest prefix wins.
+ */
+struct route_table {
+	struct route_slot *slots;
+	size_t nr_slots;	/* power of two, at least twice the routes */
+};
+
+/* routes must outlive the table. Prefixes must be distinct. */
+void route_table_init(struct route_table *rt, const struct route *routes,
+		      size_t nr_routes);
+
+/*
+ * Return the route of path, a normalized path of len bytes, and set
+ * *prefix_len to the length of its prefix. Returns NULL if none matches.
+ */
+const struct route *route_lookup(const struct route_table *rt, const char *path,
+				 size_t len, size_t *prefix_len);
+
+/*
+ * Normalize a request path in place, in one pass: decode %XX escapes,
+ * fold repeated slashes, drop "." segments and resolve ".." ones. The
+ * path has no leading '/'; *len is updated and the result NUL-terminated.
+ * Returns -1 for a bad escape, an encoded NUL or a path leaving the root.
+ */
+int route_normalize_path(char *path, size_t *len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
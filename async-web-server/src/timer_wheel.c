@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stddef.h>
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define TIMER_SLOT_MASK		(TIMER_SLOTS - 1)
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now)
+{
+	memset(tw, 0, sizeof(*tw));
+	tw->now = now;
+}
+
+static void timer_link(struct timer **head, struct timer *t)
+{
+	t->next = *head;
+	if (t->next != NULL)
+		t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+}
+
+static void timer_unlink(struct timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next != NULL)
+		t->next->pprev = t->pprev;
+	t->pprev = NULL;
+}
+
+/* Link t in the slot of the lowest level reaching its expiry tick. */
+static void timer_place(struct timer_wheel *tw, struct timer *t)
+{
+	uint64_t delta = t->expires - tw->now;
+	int level;
+
+	for (level = 0; level < TIMER_LEVELS - 1; level++)
+		if (delta < (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+			break;
+
+	timer_link(&tw->slots[level][(t->expires >> (TIMER_WHEEL_BITS * level)) &
+				     TIMER_SLOT_MASK], t);
+}
+
+void timer_arm(struct timer_wheel *tw, struct timer *t, uint64_t ticks)
+{
+	if (timer_armed(t))
+		timer_unlink(t);
+	else
+		tw->nr_timers++;
+
+	if (ticks == 0)
+		ticks = 1;
+	else if (ticks > TIMER_MAX_TICKS)
+		ticks = TIMER_MAX_TICKS;
+	t->expires = tw->now + ticks;
+	timer_place(tw, t);
+}
+
+void timer_cancel(struct timer_wheel *tw, struct timer *t)
+{
+	if (!timer_armed(t))
+		return;
+
+	timer_unlink(t);
+	tw->nr_timers--;
+}
+
+/* Move the timers of a slot of an upper level down to where they belong. */
+static void timer_cascade(struct timer_wheel *tw, int level)
+{
+	struct timer **slot;
+	struct timer *t;
+
+	slot = &tw->slots[level][(tw->now >> (TIMER_WHEEL_BITS * level)) & TIMER_SLOT_MASK];
+	while (*slot != NULL) {
+		t = *slot;
+		timer_unlink(t);
+		timer_place(tw, t);
+	}
+}
+
+void timer_wheel_advance(struct timer_wheel *tw, uint64_t now)
+{
+	struct timer **slot;
+	struct timer *t;
+	int level;
+
+	/* Nothing to run: skip the idle ticks at once. */
+	if (tw->nr_timers == 0 && now > tw->now) {
+		tw->now = now;
+		return;
+	}
+
+	while (tw->now < now) {
+		tw->now++;
+
+		/* Each wrap of a level brings the next slot of the one above. */
+		for (level = 1; level < TIMER_LEVELS; level++) {
+			if (tw->now & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1))
+				break;
+			timer_cascade(tw, level);
+		}
+
+		slot = &tw->slots[0][tw->now & TIMER_SLOT_MASK];
+		while (*slot != NULL) {
+			t = *slot;
+			timer_unlink(t);
+			tw->nr_timers--;
+			t->fn(t);
+		}
+
+		if (tw->nr_timers == 0)
+			tw->now = now;
+	}
+}
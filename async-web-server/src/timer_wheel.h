@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_	1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel counting in ticks. Level 0 has a slot per tick
+ * for the next TIMER_SLOTS ticks; each further level covers TIMER_SLOTS
+ * times as long with slots as wide as the whole level below, whose timers
+ * are moved down a level when the level below wraps around.
+ */
+#define TIMER_WHEEL_BITS	8
+#define TIMER_SLOTS		(1 << TIMER_WHEEL_BITS)
+#define TIMER_LEVELS		3
+
+/* longest delay, timers armed further away are brought forward */
+#define TIMER_MAX_TICKS		((1ULL << (TIMER_WHEEL_BITS * TIMER_LEVELS)) - 1)
+
+struct timer;
+
+typedef void (*timer_fn)(struct timer *t);
+
+/* Embedded in the object it times out; pprev is NULL while not armed. */
+struct timer {
+	struct timer *next;
+	struct timer **pprev;
+	uint64_t expires;	/* tick */
+	timer_fn fn;		/* called on expiry */
+};
+
+struct timer_wheel {
+	uint64_t now;		/* last tick run */
+	unsigned int nr_timers;
+	struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now);
+
+static inline void timer_init(struct timer *t, timer_fn fn)
+{
+	t->pprev = NULL;
+	t->fn = fn;
+}
+
+static inline int timer_armed(const struct timer *t)
+{
+	return t->pprev != NULL;
+}
+
+/* (Re)arm t to expire ticks from now, at least one. O(1). */
+void timer_arm(struct timer_wheel *tw, struct timer *t, uint64_t ticks);
+
+/* Disarm t if armed. O(1). */
+void timer_cancel(struct timer_wheel *tw, struct timer *t);
+
+/*
+ * Run every tick up to now, calling the function of the timers expiring,
+ * which are disarmed by then and may be armed again or freed by it.
+ */
+void timer_wheel_advance(struct timer_wheel *tw, uint64_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
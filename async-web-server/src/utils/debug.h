@@ -36,7 +36,14 @@ enum {
  *    /DDEBUG for MSVC
  */
 
-#if defined DEBUG
+#if defined DEBUG && defined LOG_RING
+/* queued for the flusher thread of log.c instead of written in place */
+#include "log.h"
+#define dprintf(format, ...)					\
+	log_printf(LOG_STREAM_DEBUG, " [%s(), %s:%u] " format,	\
+			__func__, __FILE__, __LINE__,	\
+			##__VA_ARGS__)
+#elif defined DEBUG
 #define dprintf(format, ...)					\
 	fprintf(stderr, " [%s(), %s:%u] " format,		\
 			__func__, __FILE__, __LINE__,	\
@@ -45,6 +52,10 @@ enum {
 #define dprintf(format, ...)
 #endif
 
+/*
+ * LOG_LEVEL is a constant, so calls above it compile to nothing: neither
+ * the record nor its arguments are evaluated.
+ */
 #if defined DEBUG
 #define dlog(level, format, ...)				\
 	do {							\
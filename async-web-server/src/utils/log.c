@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "log.h"
+
+#define LOG_FLUSH_BUFSIZ	(64 * 1024)
+
+struct log_record {
+	enum log_stream stream;
+	unsigned int len;
+	char text[LOG_RECORD_SIZE];
+};
+
+/*
+ * Single-producer single-consumer ring: the owning thread fills the slot at
+ * head, the flusher empties the one at tail. Both only ever grow, the slot
+ * used is their value modulo LOG_RING_SLOTS.
+ */
+struct log_ring {
+	struct log_ring *next;
+	unsigned long dropped;		/* written by the owner only */
+
+	unsigned int head __attribute__((aligned(64)));
+	unsigned int tail __attribute__((aligned(64)));
+
+	struct log_record records[LOG_RING_SLOTS];
+};
+
+static int log_fds[LOG_NR_STREAMS] = { -1, -1 };
+
+/* rings of all threads that logged; only ever prepended to */
+static struct log_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct log_ring *thread_ring;
+
+static struct log_ring *log_thread_ring(void)
+{
+	struct log_ring *ring = thread_ring;
+
+	if (ring != NULL)
+		return ring;
+
+	ring = calloc(1, sizeof(*ring));
+	DIE(ring == NULL, "calloc");
+
+	pthread_mutex_lock(&rings_lock);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+
+	thread_ring = ring;
+	return ring;
+}
+
+int log_enabled(enum log_stream stream)
+{
+	return log_fds[stream] >= 0;
+}
+
+void log_printf(enum log_stream stream, const char *format, ...)
+{
+	struct log_ring *ring;
+	struct log_record *rec;
+	unsigned int head;
+	va_list ap;
+	int n;
+
+	if (!log_enabled(stream))
+		return;
+
+	ring = log_thread_ring();
+	head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = &ring->records[head & (LOG_RING_SLOTS - 1)];
+	va_start(ap, format);
+	n = vsnprintf(rec->text, sizeof(rec->text), format, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+
+	/* Keep truncated records on a line of their own. */
+	if (n >= (int)sizeof(rec->text)) {
+		n = sizeof(rec->text) - 1;
+		rec->text[n - 1] = '\n';
+	}
+	rec->stream = stream;
+	rec->len = n;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return;		/* nowhere left to report it */
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+struct log_flush_buf {
+	char data[LOG_FLUSH_BUFSIZ];
+	size_t len;
+};
+
+static void log_flush_buf_add(struct log_flush_buf *fb, int fd,
+			      const char *text, size_t len)
+{
+	if (fb->len + len > sizeof(fb->data)) {
+		write_all(fd, fb->data, fb->len);
+		fb->len = 0;
+	}
+	memcpy(fb->data + fb->len, text, len);
+	fb->len += len;
+}
+
+/* Move every queued record to its stream, batching the writes. */
+static void log_flush(struct log_flush_buf *bufs, unsigned long *dropped)
+{
+	struct log_ring *ring;
+	struct log_record *rec;
+	unsigned int tail, head;
+	unsigned long nr_dropped = 0;
+	char note[64];
+	int i, n;
+
+	pthread_mutex_lock(&rings_lock);
+	ring = rings;
+	pthread_mutex_unlock(&rings_lock);
+
+	for (; ring != NULL; ring = ring->next) {
+		tail = ring->tail;
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (; tail != head; tail++) {
+			rec = &ring->records[tail & (LOG_RING_SLOTS - 1)];
+			log_flush_buf_add(&bufs[rec->stream], log_fds[rec->stream],
+					  rec->text, rec->len);
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+		nr_dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	}
+
+	if (nr_dropped != *dropped) {
+		n = snprintf(note, sizeof(note), "log: %lu records dropped\n",
+			     nr_dropped - *dropped);
+		log_flush_buf_add(&bufs[LOG_STREAM_DEBUG], log_fds[LOG_STREAM_DEBUG],
+				  note, n);
+		*dropped = nr_dropped;
+	}
+
+	for (i = 0; i < LOG_NR_STREAMS; i++) {
+		if (bufs[i].len > 0)
+			write_all(log_fds[i], bufs[i].data, bufs[i].len);
+		bufs[i].len = 0;
+	}
+}
+
+static void *log_flusher(void *arg)
+{
+	static struct log_flush_buf bufs[LOG_NR_STREAMS];
+	const struct timespec period = {
+		.tv_sec = 0,
+		.tv_nsec = LOG_FLUSH_MS * 1000000L,
+	};
+	unsigned long dropped = 0;
+
+	(void)arg;
+	while (1) {
+		nanosleep(&period, NULL);
+		log_flush(bufs, &dropped);
+	}
+
+	return NULL;
+}
+
+void log_init(int debug_fd, int access_fd)
+{
+	pthread_t thread;
+	int rc;
+
+	log_fds[LOG_STREAM_DEBUG] = debug_fd;
+	log_fds[LOG_STREAM_ACCESS] = access_fd;
+
+	rc = pthread_create(&thread, NULL, log_flusher, NULL);
+	DIE(rc != 0, "pthread_create");
+	pthread_detach(thread);
+}
+
+const char *log_date(void)
+{
+	static __thread char date[32];
+	static __thread time_t date_sec = -1;
+	time_t now = time(NULL);
+	struct tm tm;
+
+	if (now != date_sec) {
+		gmtime_r(&now, &tm);
+		strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+		date_sec = now;
+	}
+
+	return date;
+}
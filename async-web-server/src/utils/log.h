@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#ifndef LOG_H_
+#define LOG_H_		1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Non-blocking logger: each thread formats its records into a ring of its
+ * own, a background thread writes them out every LOG_FLUSH_MS. A thread
+ * never waits for the flusher; records finding its ring full are dropped
+ * and counted.
+ */
+#define LOG_RING_SLOTS		1024	/* power of two */
+#define LOG_RECORD_SIZE		256	/* longer records are truncated */
+#define LOG_FLUSH_MS		20
+
+enum log_stream {
+	LOG_STREAM_DEBUG,	/* dlog() records */
+	LOG_STREAM_ACCESS,	/* one line per request served */
+	LOG_NR_STREAMS
+};
+
+/*
+ * Start the flusher thread writing debug records to debug_fd and access
+ * records to access_fd, -1 if there is no access log.
+ */
+void log_init(int debug_fd, int access_fd);
+
+int log_enabled(enum log_stream stream);
+
+void log_printf(enum log_stream stream, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/* Common Log Format timestamp of the current second */
+const char *log_date(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
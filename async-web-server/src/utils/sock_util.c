@@ -62,7 +62,8 @@ int tcp_close_connection(int sockfd)
  * Create a server socket.
  */
 
-int tcp_create_listener(unsigned short port, int backlog)
+static int tcp_create_listener_opt(unsigned short port, int backlog,
+		int reuseport)
 {
 	struct sockaddr_in address;
 	int listenfd;
@@ -77,6 +78,12 @@ int tcp_create_listener(unsigned short port, int backlog)
 				&sock_opt, sizeof(int));
 	DIE(rc < 0, "setsockopt");
 
+	if (reuseport) {
+		rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+					&sock_opt, sizeof(int));
+		DIE(rc < 0, "setsockopt");
+	}
+
 	memset(&address, 0, sizeof(address));
 	address.sin_family = AF_INET;
 	address.sin_port = htons(port);
@@ -91,6 +98,21 @@ int tcp_create_listener(unsigned short port, int backlog)
 	return listenfd;
 }
 
+int tcp_create_listener(unsigned short port, int backlog)
+{
+	return tcp_create_listener_opt(port, backlog, 0);
+}
+
+/*
+ * Create a server socket that shares its port with other SO_REUSEPORT
+ * listeners; the kernel load balances incoming connections between them.
+ */
+
+int tcp_create_reuseport_listener(unsigned short port, int backlog)
+{
+	return tcp_create_listener_opt(port, backlog, 1);
+}
+
 /*
  * Use getpeername(2) to extract remote peer address. Fill buffer with
  * address format IP_address:port (e.g. 192.168.0.1:22).
@@ -21,6 +21,7 @@ extern "C" {
 int tcp_connect_to_server(const char *name, unsigned short port);
 int tcp_close_connection(int s);
 int tcp_create_listener(unsigned short port, int backlog);
+int tcp_create_reuseport_listener(unsigned short port, int backlog);
 int get_peer_address(int sockfd, char *buf, size_t len);
 
 #ifdef __cplusplus
@@ -121,6 +121,26 @@ static inline int w_epoll_add_ptr_inout(int epollfd, int fd, void *ptr)
 	return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
+static inline int w_epoll_add_ptr_in_et(int epollfd, int fd, void *ptr)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = ptr;
+
+	return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static inline int w_epoll_add_ptr_inout_et(int epollfd, int fd, void *ptr)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = ptr;
+
+	return epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
 static inline int w_epoll_update_ptr_in(int epollfd, int fd, void *ptr)
 {
 	struct epoll_event ev;
@@ -151,6 +171,27 @@ static inline int w_epoll_update_ptr_inout(int epollfd, int fd, void *ptr)
 	return epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
 }
 
+static inline int w_epoll_update_ptr_in_et(int epollfd, int fd, void *ptr)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = ptr;
+
+	return epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/* Keep fd registered but only report errors and hangups on it. */
+static inline int w_epoll_update_ptr_none(int epollfd, int fd, void *ptr)
+{
+	struct epoll_event ev;
+
+	ev.events = 0;
+	ev.data.ptr = ptr;
+
+	return epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
 static inline int w_epoll_remove_ptr(int epollfd, int fd, void *ptr)
 {
 	struct epoll_event ev;
@@ -170,6 +211,13 @@ static inline int w_epoll_wait_infinite(int epollfd, struct epoll_event *rev)
 {
 	return epoll_wait(epollfd, rev, 1, EPOLL_TIMEOUT_INFINITE);
 }
+
+/* Wait for up to nr events at once; timeout is in milliseconds. */
+static inline int w_epoll_wait_batch(int epollfd, struct epoll_event *revs,
+				     int nr, int timeout)
+{
+	return epoll_wait(epollfd, revs, nr, timeout);
+}
 #ifdef __cplusplus
 }
 #endif
@@ -825,6 +825,248 @@ test_get_multiple_simultaneous_stat_dyn_files()
     cleanup_test
 }
 
+test_keep_alive_pipelined_requests()
+{
+    init_test
+
+    echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.1\r\n\r\nGET /$(basename $static_folder)/small01.dat HTTP/1.1\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > keepalive.out 2> /dev/null
+
+    n_replies=$(grep -a -o 'HTTP/1.1 200 OK' keepalive.out | wc -l)
+    DEBUG echo "n_replies: $n_replies"
+    basic_test test "$n_replies" -eq 2
+
+    rm keepalive.out
+    cleanup_test
+}
+
+test_keep_alive_request_body()
+{
+    init_test
+
+    # The body looks like a request, but is only to be skipped.
+    echo -ne "POST /$(basename $static_folder)/small00.dat HTTP/1.1\r\nContent-Length: 21\r\n\r\nGET /nothere HTTP/1.1GET /$(basename $static_folder)/small01.dat HTTP/1.1\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > body.out 2> /dev/null
+
+    n_replies=$(grep -a -o 'HTTP/1.1 200 OK' body.out | wc -l)
+    DEBUG echo "n_replies: $n_replies"
+    basic_test test "$n_replies" -eq 2 -a "$(grep -a -c 'HTTP/1.1 404' body.out)" -eq 0
+
+    rm body.out
+    cleanup_test
+}
+
+test_keep_alive_head_request()
+{
+    init_test
+
+    echo -ne "HEAD /$(basename $static_folder)/large00.dat HTTP/1.1\r\n\r\nGET /$(basename $static_folder)/small01.dat HTTP/1.1\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > head.out 2> /dev/null
+
+    n_replies=$(grep -a -o 'HTTP/1.1 200 OK' head.out | wc -l)
+    DEBUG echo "n_replies: $n_replies"
+    # Two headers, then the body of the GET alone.
+    tail -c "$(stat -c %s $static_folder/small01.dat)" head.out | \
+        cmp - $static_folder/small01.dat > /dev/null 2>&1
+    code=$?
+    basic_test test "$n_replies" -eq 2 -a "$code" -eq 0 -a \
+        "$(stat -c %s head.out)" -lt "$(($(stat -c %s $static_folder/small01.dat) + 1024))"
+
+    rm head.out
+    cleanup_test
+}
+
+test_header_too_large_431()
+{
+    init_test
+
+    { echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.1\r\nX-Filler: "
+      head -c 10000 /dev/zero | tr '\0' a
+      echo -ne "\r\n\r\n"; } | \
+        nc -q 1 localhost "$aws_listen_port" > large_header.out 2> /dev/null
+
+    basic_test grep -a -q 'HTTP/1.1 431 ' large_header.out
+
+    rm large_header.out
+    cleanup_test
+}
+
+test_get_static_file_range()
+{
+    init_test
+
+    echo -ne "GET /$(basename $static_folder)/large00.dat HTTP/1.1\r\nRange: bytes=1000-2999\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > range.out 2> /dev/null
+
+    grep -a -q 'HTTP/1.1 206 Partial Content' range.out
+    code1=$?
+    tail -c 2000 range.out > range.dat
+    tail -c +1001 $static_folder/large00.dat | head -c 2000 | cmp range.dat - > /dev/null 2>&1
+    code2=$?
+    basic_test test "$code1" -eq 0 -a "$code2" -eq 0
+
+    rm range.out range.dat
+    cleanup_test
+}
+
+test_get_dyn_file_range()
+{
+    init_test
+
+    echo -ne "GET /$(basename $dynamic_folder)/large00.dat HTTP/1.1\r\nRange: bytes=-3000\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > range.out 2> /dev/null
+
+    grep -a -q 'HTTP/1.1 206 Partial Content' range.out
+    code1=$?
+    tail -c 3000 range.out > range.dat
+    tail -c 3000 $dynamic_folder/large00.dat | cmp range.dat - > /dev/null 2>&1
+    code2=$?
+    basic_test test "$code1" -eq 0 -a "$code2" -eq 0
+
+    rm range.out range.dat
+    cleanup_test
+}
+
+test_get_static_file_not_modified()
+{
+    init_test
+
+    echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.1\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > cond.out 2> /dev/null
+    etag=$(grep -a '^ETag: ' cond.out | cut -d ' ' -f 2 | tr -d '\r')
+
+    echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.1\r\nIf-None-Match: $etag\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > cond.out 2> /dev/null
+    DEBUG echo "etag: $etag"
+    basic_test grep -a -q 'HTTP/1.1 304 Not Modified' cond.out
+
+    rm cond.out
+    cleanup_test
+}
+
+test_get_dyn_file_not_modified()
+{
+    init_test
+
+    echo -ne "HEAD /$(basename $dynamic_folder)/large00.dat HTTP/1.1\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > cond.out 2> /dev/null
+    last_modified=$(grep -a '^Last-Modified: ' cond.out | cut -d ' ' -f 2- | tr -d '\r')
+
+    echo -ne "GET /$(basename $dynamic_folder)/large00.dat HTTP/1.1\r\nIf-Modified-Since: $last_modified\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > cond.out 2> /dev/null
+    DEBUG echo "last_modified: $last_modified"
+
+    grep -a -q 'HTTP/1.1 304 Not Modified' cond.out
+    code1=$?
+    # Only the header is sent.
+    [ "$(stat -c %s cond.out)" -lt 1024 ]
+    code2=$?
+    basic_test test "$code1" -eq 0 -a "$code2" -eq 0
+
+    rm cond.out
+    cleanup_test
+}
+
+test_get_file_modified_since_future()
+{
+    init_test
+
+    # Dates in the future are ignored: the file is sent in full.
+    echo -ne "GET /$(basename $static_folder)/small00.dat HTTP/1.1\r\nIf-Modified-Since: $(date -u -R -d '+1 day' | sed 's/+0000/GMT/')\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > cond.out 2> /dev/null
+
+    grep -a -q 'HTTP/1.1 200 OK' cond.out
+    code1=$?
+    tail -c "$(stat -c %s $static_folder/small00.dat)" cond.out | \
+        cmp - $static_folder/small00.dat > /dev/null 2>&1
+    code2=$?
+    basic_test test "$code1" -eq 0 -a "$code2" -eq 0
+
+    rm cond.out
+    cleanup_test
+}
+
+test_get_static_file_gzip()
+{
+    gzip -c $static_folder/small01.dat > $static_folder/small01.dat.gz
+    init_test
+
+    echo -ne "GET /$(basename $static_folder)/small01.dat HTTP/1.1\r\nAccept-Encoding: gzip, deflate\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > gzip.out 2> /dev/null
+
+    grep -a -q 'Content-Encoding: gzip' gzip.out
+    code1=$?
+    tail -c "$(stat -c %s $static_folder/small01.dat.gz)" gzip.out | \
+        cmp - $static_folder/small01.dat.gz > /dev/null 2>&1
+    code2=$?
+    basic_test test "$code1" -eq 0 -a "$code2" -eq 0
+
+    rm gzip.out $static_folder/small01.dat.gz
+    cleanup_test
+}
+
+test_get_metrics()
+{
+    init_test
+
+    wget -q -t 1 "http://localhost:8888/$(basename $static_folder)/small00.dat" -O /dev/null
+    echo -ne "GET /metrics HTTP/1.1\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > metrics.out 2> /dev/null
+
+    n_requests=$(grep -a '^aws_requests_total ' metrics.out | cut -d ' ' -f 2)
+    n_conns=$(grep -a '^aws_connection_time_to_first_byte_seconds_count ' metrics.out | cut -d ' ' -f 2)
+    DEBUG echo "n_requests: $n_requests n_conns: $n_conns"
+    basic_test test "$n_requests" -ge 1 -a "$n_conns" -ge 1
+
+    rm metrics.out
+    cleanup_test
+}
+
+test_get_changed_file()
+{
+    init_test
+
+    wget -q -t 1 "http://localhost:8888/$(basename $static_folder)/small02.dat" -O /dev/null
+    wget -q -t 1 "http://localhost:8888/$(basename $dynamic_folder)/small02.dat" -O /dev/null
+
+    # Changed in place, and reached as the target of the dynamic link too.
+    cp $static_folder/small02.dat small02.orig
+    dd if=/dev/urandom of=small02.new bs=1K count=3 2> /dev/null
+    cat small02.new > $static_folder/small02.dat
+    sleep 0.1
+
+    wget -q -t 1 "http://localhost:8888/$(basename $static_folder)/small02.dat" -O changed_static.out
+    wget -q -t 1 "http://localhost:8888/$(basename $dynamic_folder)/small02.dat" -O changed_dyn.out
+    cmp -s changed_static.out small02.new
+    code1=$?
+    cmp -s changed_dyn.out small02.new
+    code2=$?
+    basic_test test "$code1" -eq 0 -a "$code2" -eq 0
+
+    cat small02.orig > $static_folder/small02.dat
+    rm small02.orig small02.new changed_static.out changed_dyn.out
+    cleanup_test
+}
+
+test_normalized_path()
+{
+    init_test
+
+    echo -ne "GET /$(basename $dynamic_folder)/..//$(basename $static_folder)/./small03.dat HTTP/1.1\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > path.out 2> /dev/null
+    grep -a -q 'HTTP/1.1 200 OK' path.out
+    code1=$?
+    # Served as static only by its prefix, but outside of the static folder.
+    echo -ne "GET /$(basename $static_folder)/../_test/run_test.sh HTTP/1.1\r\nConnection: close\r\n\r\n" | \
+        nc -q 1 localhost "$aws_listen_port" > path.out 2> /dev/null
+    grep -a -q 'HTTP/1.1 404' path.out
+    code2=$?
+    basic_test test "$code1" -eq 0 -a "$code2" -eq 0
+
+    rm path.out
+    cleanup_test
+}
+
 # Specifies the tests, commands and points
 test_fun_array=( \
     test_executable_exists "Test executable exists" 1 0
@@ -862,6 +1104,19 @@ test_get_two_simultaneous_dyn_files "Test get two simultaneous dynamic files" 4
 test_get_multiple_simultaneous_dyn_files "Test get multiple simultaneous dynamic files" 5 1
 test_get_two_simultaneous_stat_dyn_files "Test get two simultaneous static and dynamic files" 3 1
 test_get_multiple_simultaneous_stat_dyn_files "Test get multiple simultaneous static and dynamic files" 4 1
+test_keep_alive_pipelined_requests "Test keep-alive pipelined requests" 1 0
+test_keep_alive_request_body "Test keep-alive request body skipped" 1 0
+test_keep_alive_head_request "Test keep-alive HEAD request" 1 0
+test_header_too_large_431 "Test header too large 431" 1 0
+test_get_static_file_range "Test static file range request" 1 0
+test_get_dyn_file_range "Test dynamic file range request" 1 0
+test_get_static_file_not_modified "Test static file If-None-Match 304" 1 0
+test_get_dyn_file_not_modified "Test dynamic file If-Modified-Since 304" 1 0
+test_get_file_modified_since_future "Test If-Modified-Since in the future ignored" 1 0
+test_get_static_file_gzip "Test static file precompressed gzip" 1 0
+test_get_metrics "Test metrics endpoint" 1 0
+test_get_changed_file "Test changed file served fresh" 1 0
+test_normalized_path "Test normalized request path" 1 0
 )
 
 # ---------------------------------------------------------------------------- #
@@ -0,0 +1,601 @@
+// SPDX-License-Identifier: BSD-3-Clause
+
+/*
+ * HTTP load generator for aws, on a single epoll loop.
+ *
+ * Closed loop (default): each of the -c connections sends its next request
+ * as soon as the previous reply is in. Open loop (-r): requests are started
+ * at a fixed rate on whichever connection is free, and latency counts from
+ * when a request was due, so a server falling behind is not hidden by the
+ * client waiting for it.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "utils/util.h"
+
+#define BENCH_MAX_CONNS		4096
+#define BENCH_MAX_TARGETS	16
+#define BENCH_EPOLL_BATCH	256
+#define BENCH_REQUEST_MAX	512
+#define BENCH_HEADER_MAX	4096
+#define BENCH_RECV_BUFSIZ	(256 * 1024)
+
+/* open loop: due requests waiting for a free connection */
+#define BENCH_BACKLOG		(1 << 16)
+
+enum bench_state {
+	CONN_IDLE,
+	CONN_CONNECTING,
+	CONN_SENDING,
+	CONN_RECV_HEADER,
+	CONN_RECV_BODY
+};
+
+struct bench_target {
+	const char *path;
+	unsigned int weight;
+};
+
+struct bench_conn {
+	int fd;
+	enum bench_state state;
+	struct bench_conn *next_idle;
+
+	char request[BENCH_REQUEST_MAX];
+	size_t request_len;
+	size_t request_pos;
+
+	char header[BENCH_HEADER_MAX];
+	size_t header_len;
+	long long body_left;	/* -1: until the server closes */
+	int close_after;
+
+	uint64_t start;		/* when the request was due, in microseconds */
+};
+
+/* results, over requests due after the warmup */
+struct bench_stats {
+	uint32_t *latencies;	/* microseconds */
+	size_t nr;
+	size_t size;
+	unsigned long errors;
+	unsigned long long bytes;
+	unsigned long non_2xx;
+};
+
+static struct bench_target targets[BENCH_MAX_TARGETS];
+static int nr_targets;
+static unsigned int total_weight;
+
+static struct sockaddr_in server_addr;
+static int keep_alive = 1;
+static int open_loop;
+static int epollfd;
+
+static struct bench_conn conns[BENCH_MAX_CONNS];
+static int nr_conns = 32;
+static struct bench_conn *idle_conns;
+
+static uint64_t backlog[BENCH_BACKLOG];
+static unsigned int backlog_head, backlog_tail;
+
+static uint64_t measure_from;
+static struct bench_stats stats;
+static uint64_t rng_state = 88172645463325252ULL;
+
+static char recv_buf[BENCH_RECV_BUFSIZ];
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64, enough to pick targets */
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+
+	return rng_state;
+}
+
+static const struct bench_target *pick_target(void)
+{
+	unsigned int w;
+	int i;
+
+	if (nr_targets == 1)
+		return &targets[0];
+
+	w = rng_next() % total_weight;
+	for (i = 0; i < nr_targets - 1; i++) {
+		if (w < targets[i].weight)
+			break;
+		w -= targets[i].weight;
+	}
+
+	return &targets[i];
+}
+
+static void stats_record(uint64_t start, uint64_t end)
+{
+	if (start < measure_from)
+		return;
+
+	if (stats.nr == stats.size) {
+		stats.size = stats.size ? 2 * stats.size : 1 << 16;
+		stats.latencies = realloc(stats.latencies,
+					  stats.size * sizeof(*stats.latencies));
+		DIE(stats.latencies == NULL, "realloc");
+	}
+	stats.latencies[stats.nr++] = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+}
+
+static void conn_watch(struct bench_conn *c, uint32_t events, int op)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = c };
+	int rc;
+
+	rc = epoll_ctl(epollfd, op, c->fd, &ev);
+	DIE(rc < 0, "epoll_ctl");
+}
+
+static void conn_close(struct bench_conn *c)
+{
+	if (c->fd < 0)
+		return;
+
+	close(c->fd);	/* also leaves the epoll set */
+	c->fd = -1;
+}
+
+static void conn_send(struct bench_conn *c);
+static void conn_fail(struct bench_conn *c);
+
+/* Start the request due at start on an idle connection. */
+static void conn_start(struct bench_conn *c, uint64_t start)
+{
+	const struct bench_target *t = pick_target();
+	int one = 1;
+	int rc;
+
+	c->start = start;
+	c->request_len = snprintf(c->request, sizeof(c->request),
+				  "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: %s\r\n\r\n",
+				  t->path, keep_alive ? "keep-alive" : "close");
+	c->request_pos = 0;
+	c->header_len = 0;
+	c->close_after = !keep_alive;
+
+	if (c->fd >= 0) {
+		c->state = CONN_SENDING;
+		conn_send(c);
+		return;
+	}
+
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	DIE(c->fd < 0, "socket");
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	c->state = CONN_CONNECTING;
+	rc = connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr));
+	DIE(rc < 0 && errno != EINPROGRESS, "connect");
+	conn_watch(c, EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+/* The connection is free again: give it the next request, if any is due. */
+static void conn_done(struct bench_conn *c)
+{
+	c->state = CONN_IDLE;
+
+	if (!open_loop) {
+		conn_start(c, now_usec());
+		return;
+	}
+
+	if (backlog_head != backlog_tail) {
+		conn_start(c, backlog[backlog_head++ % BENCH_BACKLOG]);
+		return;
+	}
+
+	c->next_idle = idle_conns;
+	idle_conns = c;
+}
+
+static void conn_fail(struct bench_conn *c)
+{
+	if (c->start >= measure_from)
+		stats.errors++;
+	conn_close(c);
+	conn_done(c);
+}
+
+static void conn_send(struct bench_conn *c)
+{
+	ssize_t n;
+
+	while (c->request_pos < c->request_len) {
+		n = send(c->fd, c->request + c->request_pos,
+			 c->request_len - c->request_pos, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN) {
+				conn_watch(c, EPOLLOUT, EPOLL_CTL_MOD);
+				return;
+			}
+			conn_fail(c);
+			return;
+		}
+		c->request_pos += n;
+	}
+
+	c->state = CONN_RECV_HEADER;
+	conn_watch(c, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+/* Parse the status line and headers once all of them are in. */
+static int conn_parse_header(struct bench_conn *c, size_t *header_end)
+{
+	char *end, *p;
+	int status;
+
+	c->header[c->header_len] = '\0';
+	end = strstr(c->header, "\r\n\r\n");
+	if (end == NULL)
+		return 0;
+	*end = '\0';
+	*header_end = end + 4 - c->header;
+
+	if (sscanf(c->header, "HTTP/%*d.%*d %d", &status) != 1)
+		return -1;
+	if (status < 200 || status > 299)
+		stats.non_2xx += c->start >= measure_from;
+
+	c->body_left = -1;
+	p = strcasestr(c->header, "\r\nContent-Length:");
+	if (p != NULL)
+		c->body_left = strtoll(p + strlen("\r\nContent-Length:"), NULL, 10);
+	else if (status == 304 || status == 204)
+		c->body_left = 0;
+
+	if (strcasestr(c->header, "\r\nConnection: close") != NULL)
+		c->close_after = 1;
+
+	return 1;
+}
+
+static void conn_recv(struct bench_conn *c)
+{
+	size_t header_end, extra;
+	ssize_t n;
+	int rc;
+
+	while (1) {
+		if (c->state == CONN_RECV_HEADER) {
+			n = recv(c->fd, c->header + c->header_len,
+				 sizeof(c->header) - 1 - c->header_len, 0);
+		} else {
+			n = recv(c->fd, recv_buf, sizeof(recv_buf), 0);
+		}
+		if (n < 0 && errno == EAGAIN)
+			return;
+
+		if (n <= 0) {
+			/* A reply without Content-Length ends with the connection. */
+			if (c->state == CONN_RECV_BODY && c->body_left < 0) {
+				stats_record(c->start, now_usec());
+				conn_close(c);
+				conn_done(c);
+			} else {
+				conn_fail(c);
+			}
+			return;
+		}
+
+		if (c->start >= measure_from)
+			stats.bytes += n;
+
+		if (c->state == CONN_RECV_HEADER) {
+			c->header_len += n;
+			rc = conn_parse_header(c, &header_end);
+			if (rc < 0 || (rc == 0 && c->header_len == sizeof(c->header) - 1)) {
+				conn_fail(c);
+				return;
+			}
+			if (rc == 0)
+				continue;
+
+			c->state = CONN_RECV_BODY;
+			extra = c->header_len - header_end;
+			if (c->body_left >= 0)
+				c->body_left -= extra;
+		} else if (c->body_left >= 0) {
+			c->body_left -= n;
+		}
+
+		if (c->body_left == 0) {
+			stats_record(c->start, now_usec());
+			if (c->close_after)
+				conn_close(c);
+			conn_done(c);
+			return;
+		}
+		if (c->body_left < -1) {
+			/* more than announced: the connection is out of sync */
+			conn_fail(c);
+			return;
+		}
+	}
+}
+
+static void conn_handle(struct bench_conn *c, uint32_t events)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (c->state == CONN_CONNECTING) {
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0) {
+			conn_fail(c);
+			return;
+		}
+		c->state = CONN_SENDING;
+	}
+
+	if (c->state == CONN_SENDING && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+		conn_send(c);
+	if (c->state == CONN_RECV_HEADER || c->state == CONN_RECV_BODY)
+		conn_recv(c);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t percentile(double p)
+{
+	size_t i;
+
+	if (stats.nr == 0)
+		return 0;
+
+	i = (size_t)(p * stats.nr);
+	if (i >= stats.nr)
+		i = stats.nr - 1;
+
+	return stats.latencies[i];
+}
+
+/* CPU time used by pid so far, in microseconds; 0 when unknown. */
+static uint64_t proc_cpu_usec(int pid)
+{
+	unsigned long utime, stime;
+	char path[64];
+	char buf[1024];
+	char *p;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	p = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (p == NULL)
+		return 0;
+
+	/* Fields 14 and 15, counted from after the command name. */
+	p = strrchr(buf, ')');
+	if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+				&utime, &stime) != 2)
+		return 0;
+
+	return (uint64_t)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+static uint64_t self_cpu_usec(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+	       ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [-c conns] [-r rate] [-d seconds] [-w seconds]\n"
+		"          [-k on|off] [-p port] [-P server_pid] path[:weight]...\n"
+		"  -c conns     connections, 1..%d (default 32); the most used with -r\n"
+		"  -r rate      open loop: start requests at this rate per second\n"
+		"  -d seconds   measured run time (default 10)\n"
+		"  -w seconds   warmup left out of the results (default 1)\n"
+		"  -k on|off    persistent connections (default on)\n"
+		"  -p port      server port on 127.0.0.1 (default 8888)\n"
+		"  -P pid       also report the CPU time the server used\n",
+		argv0, BENCH_MAX_CONNS);
+	exit(EXIT_FAILURE);
+}
+
+static void add_target(const char *argv0, char *arg)
+{
+	char *weight = strrchr(arg, ':');
+
+	if (nr_targets == BENCH_MAX_TARGETS || arg[0] != '/')
+		usage(argv0);
+
+	targets[nr_targets].weight = 1;
+	if (weight != NULL) {
+		*weight = '\0';
+		targets[nr_targets].weight = atoi(weight + 1);
+		if (targets[nr_targets].weight == 0)
+			usage(argv0);
+	}
+	targets[nr_targets].path = arg;
+	total_weight += targets[nr_targets].weight;
+	nr_targets++;
+}
+
+int main(int argc, char *argv[])
+{
+	struct epoll_event events[BENCH_EPOLL_BATCH];
+	double duration = 10, warmup = 1, rate = 0, elapsed;
+	uint64_t start, end, next_due = 0, interval = 0, now;
+	uint64_t cpu_self = 0, cpu_server = 0;
+	unsigned long dropped = 0;
+	int port = 8888, server_pid = 0;
+	int cpu_marked = 0;
+	int timeout;
+	int opt, rc, i;
+
+	while ((opt = getopt(argc, argv, "c:r:d:w:k:p:P:")) != -1) {
+		switch (opt) {
+		case 'c':
+			nr_conns = atoi(optarg);
+			if (nr_conns < 1 || nr_conns > BENCH_MAX_CONNS)
+				usage(argv[0]);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'w':
+			warmup = atof(optarg);
+			break;
+		case 'k':
+			keep_alive = strcmp(optarg, "off") != 0;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'P':
+			server_pid = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	for (i = optind; i < argc; i++)
+		add_target(argv[0], argv[i]);
+	if (nr_targets == 0 || duration <= 0 || warmup < 0 || rate < 0)
+		usage(argv[0]);
+
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	DIE(epollfd < 0, "epoll_create1");
+
+	open_loop = rate > 0;
+	start = now_usec();
+	measure_from = start + warmup * 1000000;
+	end = measure_from + duration * 1000000;
+
+	for (i = 0; i < nr_conns; i++) {
+		conns[i].fd = -1;
+		conns[i].state = CONN_IDLE;
+		if (open_loop) {
+			conns[i].next_idle = idle_conns;
+			idle_conns = &conns[i];
+		} else {
+			conn_start(&conns[i], start);
+		}
+	}
+	if (open_loop) {
+		interval = 1000000 / rate;
+		if (interval == 0)
+			interval = 1;
+		next_due = start;
+	}
+
+	while (1) {
+		now = now_usec();
+		if (now >= measure_from && !cpu_marked) {
+			cpu_server = proc_cpu_usec(server_pid);
+			cpu_self = self_cpu_usec();
+			cpu_marked = 1;
+		}
+		if (now >= end)
+			break;
+
+		/* Start every request due by now; the rest wait in the backlog. */
+		while (open_loop && next_due <= now) {
+			if (idle_conns != NULL) {
+				struct bench_conn *c = idle_conns;
+
+				idle_conns = c->next_idle;
+				conn_start(c, next_due);
+			} else if (backlog_tail - backlog_head < BENCH_BACKLOG) {
+				backlog[backlog_tail++ % BENCH_BACKLOG] = next_due;
+			} else {
+				dropped++;
+			}
+			next_due += interval;
+		}
+
+		timeout = open_loop ? (int)((next_due - now + 999) / 1000) : 100;
+		rc = epoll_wait(epollfd, events, BENCH_EPOLL_BATCH, timeout);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		DIE(rc < 0, "epoll_wait");
+
+		for (i = 0; i < rc; i++)
+			conn_handle(events[i].data.ptr, events[i].events);
+	}
+	elapsed = (now_usec() - measure_from) / 1e6;
+	cpu_self = self_cpu_usec() - cpu_self;
+	cpu_server = proc_cpu_usec(server_pid) - cpu_server;
+
+	qsort(stats.latencies, stats.nr, sizeof(*stats.latencies), cmp_u32);
+
+	printf("mode=%s conns=%d keepalive=%s duration=%.1f",
+	       open_loop ? "open" : "closed", nr_conns, keep_alive ? "on" : "off",
+	       elapsed);
+	if (open_loop)
+		printf(" rate=%.0f backlog=%u dropped=%lu", rate,
+		       backlog_tail - backlog_head, dropped);
+	printf("\nrequests=%zu errors=%lu non_2xx=%lu rps=%.1f mbps=%.1f\n",
+	       stats.nr, stats.errors, stats.non_2xx, stats.nr / elapsed,
+	       stats.bytes / elapsed / (1 << 20));
+	printf("latency_us p50=%u p99=%u p999=%u max=%u\n",
+	       percentile(0.5), percentile(0.99), percentile(0.999),
+	       stats.nr ? stats.latencies[stats.nr - 1] : 0);
+	printf("cpu_us_per_req client=%.1f", stats.nr ? (double)cpu_self / stats.nr : 0);
+	if (server_pid > 0)
+		printf(" server=%.1f", stats.nr ? (double)cpu_server / stats.nr : 0);
+	printf("\n");
+
+	for (i = 0; i < nr_conns; i++)
+		conn_close(&conns[i]);
+	free(stats.latencies);
+
+	return stats.errors > 0;
+}
@@ -0,0 +1,80 @@
+#!/bin/bash
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Run the aws benchmark matrix against a fresh server on localhost: small,
+# large and mixed static and dynamic files, with and without keep-alive, in
+# closed loop, then an open-loop run at a fixed rate.
+#
+# Environment: SRC_PATH (aws build), DURATION and WARMUP (seconds per run),
+# CONNS (connections), RATE (open loop requests per second), AWS_ARGS
+# (server options, e.g. "-w 4 -e").
+
+cd "$(dirname "$0")" || exit 1
+
+if test -z "$SRC_PATH"; then
+    SRC_PATH=$(pwd)/../../src
+fi
+DURATION=${DURATION:-10}
+WARMUP=${WARMUP:-1}
+CONNS=${CONNS:-32}
+RATE=${RATE:-5000}
+
+www=_www
+aws_listen_port=8888
+
+make -s aws_bench || exit 1
+test -x "$SRC_PATH"/aws || { echo "build aws in $SRC_PATH first" >&2; exit 1; }
+
+# Same content under both folders: static and dynamic costs compare directly.
+mkdir -p "$www"/static "$www"/dynamic
+for spec in small:1K large:1M; do
+    name=${spec%%:*}
+    size=${spec##*:}
+    if ! test -f "$www"/static/"$name".dat; then
+        dd if=/dev/urandom of="$www"/static/"$name".dat bs="$size" count=1 2> /dev/null
+        cp "$www"/static/"$name".dat "$www"/dynamic/"$name".dat
+    fi
+done
+
+# shellcheck disable=SC2086
+(cd "$www" && exec "$SRC_PATH"/aws $AWS_ARGS) > /dev/null 2>&1 &
+aws_pid=$!
+trap 'kill $aws_pid 2> /dev/null' EXIT
+
+for _ in $(seq 50); do
+    (exec 3<> /dev/tcp/127.0.0.1/$aws_listen_port) 2> /dev/null && break
+    sleep 0.1
+done
+
+field()
+{
+    echo "$1" | grep -o "\<$2=[0-9.]*" | cut -d= -f2
+}
+
+run()
+{
+    local name=$1
+    shift
+
+    out=$(./aws_bench -P $aws_pid -d "$DURATION" -w "$WARMUP" -c "$CONNS" "$@")
+    printf "%-24s %10s %9s %8s %8s %8s %10s %7s\n" "$name" \
+        "$(field "$out" rps)" "$(field "$out" mbps)" \
+        "$(field "$out" p50)" "$(field "$out" p99)" "$(field "$out" p999)" \
+        "$(field "$out" server)" "$(field "$out" errors)"
+}
+
+printf "%-24s %10s %9s %8s %8s %8s %10s %7s\n" "scenario" "req/s" "MiB/s" \
+    "p50 us" "p99 us" "p999 us" "cpu us/req" "errors"
+
+for ka in on off; do
+    run "static small ka=$ka" -k $ka /static/small.dat
+    run "static large ka=$ka" -k $ka /static/large.dat
+    run "dynamic small ka=$ka" -k $ka /dynamic/small.dat
+    run "dynamic large ka=$ka" -k $ka /dynamic/large.dat
+    run "mix ka=$ka" -k $ka /static/small.dat:8 /static/large.dat:1 \
+        /dynamic/small.dat:4 /dynamic/large.dat:1
+done
+
+run "open static small r=$RATE" -r "$RATE" /static/small.dat
+run "open mix r=$RATE" -r "$RATE" /static/small.dat:8 /static/large.dat:1 \
+    /dynamic/small.dat:4 /dynamic/large.dat:1